@@ -0,0 +1,123 @@
+/*
+ * Copyright 2016, Victor van der Veen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+#if defined(__arm__)
+#include <asm/unistd.h>
+#endif
+
+#include "cache.h"
+#include "helper.h"
+#include "ion.h"
+
+#define CACHE_BENCH_LEN    K(64)
+#define CACHE_BENCH_ROUNDS 16
+
+bool cache_maintenance = false;
+uint64_t cache_ns = 0;
+
+static int line_size = 64;
+static const char *method = "none";
+
+#if defined(__x86_64__) || defined(__i386__)
+static bool have_clflushopt = false;
+#endif
+
+/* Cache maintenance by line: x86 has clflush and, on newer CPUs, the weakly
+ * ordered clflushopt; ARMv8 has dc civac (clean and invalidate to the point of
+ * coherency) at EL0. ARMv7 has no unprivileged cache maintenance, so we ask
+ * the kernel with the cacheflush syscall, which only cleans to the point of
+ * unification: an outer cache may still hold the data. */
+void CACHE_flush_range(void *addr, size_t len) {
+    uint64_t t1 = get_ns();
+    uintptr_t start = (uintptr_t) addr & ~((uintptr_t) line_size - 1);
+    uintptr_t end   = (uintptr_t) addr + len;
+#if defined(__x86_64__) || defined(__i386__)
+    if (have_clflushopt) {
+        for (uintptr_t p = start; p < end; p += line_size) 
+            asm volatile(".byte 0x66; clflush (%0)" :: "r" (p) : "memory");   // clflushopt
+    } else {
+        for (uintptr_t p = start; p < end; p += line_size) 
+            asm volatile("clflush (%0)" :: "r" (p) : "memory");
+    }
+    asm volatile("mfence" ::: "memory");
+#elif defined(__aarch64__)
+    for (uintptr_t p = start; p < end; p += line_size) 
+        asm volatile("dc civac, %0" :: "r" (p) : "memory");
+    asm volatile("dsb sy" ::: "memory");
+#elif defined(__arm__)
+    syscall(__ARM_NR_cacheflush, start, end, 0);
+#endif
+    cache_ns += get_ns() - t1;
+}
+
+/* Pick the flush method for this CPU and measure what it costs on a dirty
+ * buffer. Maintenance is only enabled if the heap is cached. */
+void CACHE_init(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid_max(0, NULL) >= 7) {
+        __cpuid_count(7, 0, eax, ebx, ecx, edx);
+        have_clflushopt = ebx & (1 << 23);
+    }
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) 
+        line_size = ((ebx >> 8) & 0xff) * 8;
+    if (line_size == 0) line_size = 64;
+    method = have_clflushopt ? "clflushopt" : "clflush";
+#elif defined(__aarch64__)
+    uint64_t ctr;
+    asm volatile("mrs %0, ctr_el0" : "=r" (ctr));
+    line_size = 4 << ((ctr >> 16) & 0xf);   // DminLine: log2 of the smallest line in words
+    method = "dc civac";
+#elif defined(__arm__)
+    method = "cacheflush syscall";
+#endif
+
+    cache_maintenance = false;
+    cache_ns = 0;
+    if (!ion_cached) {
+        print("[CACHE] Heap is uncached, no cache maintenance needed\n");
+        return;
+    }
+
+    uint8_t *buf = (uint8_t *) malloc(CACHE_BENCH_LEN);
+    if (buf == NULL) {
+        perror("Could not allocate cache benchmark buffer");
+        exit(EXIT_FAILURE);
+    }
+    uint64_t flush_ns = 0;
+    for (int i = 0; i < CACHE_BENCH_ROUNDS; i++) {
+        memset(buf, i, CACHE_BENCH_LEN);
+        uint64_t t1 = get_ns();
+        CACHE_flush_range(buf, CACHE_BENCH_LEN);
+        flush_ns += get_ns() - t1;
+    }
+    free(buf);
+
+    cache_maintenance = true;
+    cache_ns = 0;
+    print("[CACHE] Heap is cached, flushing rows with %s (%d-byte lines): %.1f us per dirty %d KB\n", 
+            method, line_size, flush_ns / 1000.0 / CACHE_BENCH_ROUNDS, CACHE_BENCH_LEN / 1024);
+}
@@ -0,0 +1,40 @@
+/*
+ * Copyright 2016, Victor van der Veen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Cache maintenance around pattern writes and verification. Only needed if
+ * our heap maps its buffers cached (see ION_probe_caching()): then a pattern
+ * written with memcpy() may still sit in the cache while we hammer, and a
+ * verify read may be served from the cache and miss a flip in DRAM. On
+ * uncached heaps, CACHE_flush() is a single branch. */
+extern bool cache_maintenance;   // our heap is cached and we have a way to flush
+extern uint64_t cache_ns;        // time spent flushing, for the templating summary
+
+void CACHE_init(void);
+void CACHE_flush_range(void *addr, size_t len);
+
+/* clean and invalidate [addr, addr + len) down to DRAM */
+static inline void CACHE_flush(void *addr, size_t len) {
+    if (cache_maintenance) CACHE_flush_range(addr, len);
+}
+
+#endif // __CACHE_H__
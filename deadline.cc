@@ -0,0 +1,125 @@
+/*
+ * Copyright 2016, Victor van der Veen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <string>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "deadline.h"
+#include "helper.h"
+
+/* Deadlines are absolute CLOCK_MONOTONIC times (see get_ns()), so they do not
+ * depend on signals: phases can no longer overwrite each other's SIGALRM
+ * handler, and wall clock changes do not matter. Expiry is sticky, and
+ * cancellation holds for all phases that follow. */
+static std::map<std::string, int> budgets;   // seconds per phase
+
+static std::string phase;
+static uint64_t start_ns;
+static uint64_t deadline_ns;                 // 0 if the phase has no budget
+static uint64_t noticed_ns;                  // first DL_expired() that returned true
+static std::atomic<bool> expired(false);
+static std::atomic<bool> cancelled(false);
+static std::atomic<uint64_t> cancel_ns(0);
+
+bool DL_budget(const char *spec) {
+    const char *colon = strchr(spec, ':');
+    if (colon == NULL || colon == spec) return false;
+    char *end;
+    long seconds = strtol(colon + 1, &end, 10);
+    if (*end != '\0' || seconds < 0) return false;
+    budgets[std::string(spec, colon - spec)] = seconds;
+    return true;
+}
+
+void DL_budget(const char *name, int seconds) {
+    budgets[name] = seconds;
+}
+
+void DL_phase(const char *name) {
+    DL_end();
+
+    phase = name;
+    start_ns = get_ns();
+    noticed_ns = 0;
+    expired = false;
+    int seconds = budgets.count(phase) ? budgets[phase] : 0;
+    deadline_ns = seconds ? start_ns + seconds * 1000000000ULL : 0;
+    if (seconds) print("[DL] Phase %s: budget %d seconds\n", name, seconds);
+}
+
+/* close the current phase, reporting the overshoot if it had a deadline */
+void DL_end(void) {
+    if (phase.empty()) return;
+
+    uint64_t now = get_ns();
+    if (noticed_ns) {
+        /* expired at the deadline, or when cancelled (at the earliest when the phase started) */
+        uint64_t expiry = cancelled ? std::max(cancel_ns.load(), start_ns) : deadline_ns;
+        if (deadline_ns && deadline_ns < expiry) expiry = deadline_ns;
+        uint64_t late = noticed_ns > expiry ? noticed_ns - expiry : 0;
+        print("[DL] Phase %s: stopped by %s | noticed after %.3f ms | wrapped up in %.3f ms | total %.3f s\n", 
+                phase.c_str(), expiry == deadline_ns ? "deadline" : "cancellation", 
+                late / 1e6, (now - noticed_ns) / 1e6, (now - start_ns) / 1e9);
+    } else if (deadline_ns) {
+        print("[DL] Phase %s: done %.3f s before its deadline\n", 
+                phase.c_str(), now < deadline_ns ? (deadline_ns - now) / 1e9 : 0.0);
+    }
+    phase.clear();
+    deadline_ns = 0;
+    expired = false;
+}
+
+bool DL_expired(void) {
+    if (expired) return true;
+    if (cancelled || (deadline_ns && get_ns() >= deadline_ns)) {
+        noticed_ns = get_ns();
+        expired = true;
+        if (cancelled) 
+            printf("\n[DL] Cancelled, wrapping up\n");
+        else
+            printf("\n[TIME] is up, wrapping up\n");
+        return true;
+    }
+    return false;
+}
+
+uint64_t DL_remaining_ns(void) {
+    if (expired || cancelled) return 0;
+    if (!deadline_ns) return UINT64_MAX;
+    uint64_t now = get_ns();
+    return now < deadline_ns ? deadline_ns - now : 0;
+}
+
+void DL_cancel(void) {
+    if (!cancelled) cancel_ns = get_ns();
+    cancelled = true;
+}
+
+bool DL_cancelled(void) {
+    return cancelled;
+}
+
+void DL_reset(void) {
+    cancelled = false;
+    cancel_ns = 0;
+}
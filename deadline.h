@@ -0,0 +1,38 @@
+/*
+ * Copyright 2016, Victor van der Veen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef __DEADLINE_H__
+#define __DEADLINE_H__
+
+#include <stdint.h>
+
+/* Every phase of a run (defrag, rowsize, exhaust, mapping, templating) can
+ * get a time budget. Long running loops poll DL_expired(), which turns true
+ * once the budget of the current phase is used up or the run was cancelled
+ * (DL_cancel(), e.g. on SIGINT). When a phase ends, we report how late the
+ * expiry was noticed and how long the phase took to wrap up after that. */
+bool     DL_budget(const char *spec);    // "<phase>:<seconds>"
+void     DL_budget(const char *phase, int seconds);
+void     DL_phase(const char *phase);
+void     DL_end(void);
+bool     DL_expired(void);
+uint64_t DL_remaining_ns(void);
+void     DL_cancel(void);                // async-signal-safe
+bool     DL_cancelled(void);
+void     DL_reset(void);                 // forget a cancellation, for callers that go on (libdrammer)
+
+#endif // __DEADLINE_H__
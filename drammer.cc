@@ -0,0 +1,295 @@
+/*
+ * Copyright 2016, Victor van der Veen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include "deadline.h"
+#include "drammer.h"
+#include "helper.h"
+#include "ion.h"
+#include "massage.h"
+#include "metrics.h"
+#include "rowsize.h"
+#include "templating.h"
+
+#define DRAMMER_READCOUNT  1000000
+#define DRAMMER_RANDOM_USE 100      // uses of a random row before it is regenerated
+
+FILE *global_of = NULL;
+
+static bool initialized = false;
+static struct ion_chunks chunks;
+static struct template_arena *templates;
+
+/* Patterns live as long as the library, so that the names of old flips stay
+ * valid. Rows are MAX_ROWSIZE bytes, so a new row size needs no new rows. */
+static std::vector<struct pattern_t *> pattern_pool;
+static std::vector<struct pattern_t *> run_patterns;    // patterns of the current test
+
+/* Per flip: its pattern name and the allocation it was found in. A flip only
+ * has a virtual address while its allocation is held. */
+static std::vector<const char *> flip_pattern;
+static std::vector<int> flip_allocation;
+static int allocation = 0;
+
+static drammer_flip_cb     user_on_flip;
+static drammer_progress_cb user_on_progress;
+static void               *user_arg;
+
+
+static struct pattern_t *get_pattern(const char *name) {
+    if (name == NULL || strlen(name) != 3 || strspn(name, "01r") != 3) return NULL;
+
+    for (auto pattern : pattern_pool)
+        if (!strcmp(pattern->name, name)) return pattern;
+
+    struct pattern_t *pattern = new pattern_t();
+    pattern->name = strdup(name);
+    uint8_t **rows[3] = { &pattern->above, &pattern->victim, &pattern->below };
+    for (int i = 0; i < 3; i++) {
+        *rows[i] = (uint8_t *) malloc(MAX_ROWSIZE);
+        if (*rows[i] == NULL) {
+            perror("Could not allocate pattern");
+            exit(EXIT_FAILURE);
+        }
+        memset(*rows[i], name[i] == '1' ? 0xff : 0x00, MAX_ROWSIZE);
+        if (name[i] == 'r') pattern->max_use = DRAMMER_RANDOM_USE;
+    }
+    pattern_pool.push_back(pattern);
+    return pattern;
+}
+
+static void fill_flip(const struct template_t *tmpl, const char *pattern, int alloc, struct drammer_flip *flip) {
+    flip->phys_addr   = tmpl->phys_addr;
+    flip->virt_addr   = 0;
+    if (alloc == allocation && tmpl->chunk < chunks.size() && chunks.mapping[tmpl->chunk])
+        flip->virt_addr = (uintptr_t) chunks.mapping[tmpl->chunk] + tmpl->rel_address;
+    flip->chunk       = tmpl->chunk;
+    flip->rel_address = tmpl->rel_address;
+    flip->org_byte    = tmpl_org_byte(tmpl);
+    flip->new_byte    = tmpl_new_byte(tmpl);
+    flip->bit         = tmpl_bit_index_in_word(tmpl);
+    flip->one_to_zero = tmpl_direction(tmpl) == ONE_TO_ZERO;
+    flip->exploitable = tmpl_exploitable(tmpl);
+    flip->pattern     = pattern;
+    flip->found_at    = tmpl->found_at;
+}
+
+static void on_flip(const struct template_t *tmpl, void *arg) {
+    if (user_on_flip == NULL) return;
+
+    struct drammer_flip flip;
+    fill_flip(tmpl, run_patterns[tmpl->pattern]->name, allocation, &flip);
+    user_on_flip(&flip, user_arg);
+}
+
+static void on_progress(const struct met_snapshot *snapshot, void *arg) {
+    if (user_on_progress == NULL) return;
+
+    struct drammer_progress progress;
+    progress.flips          = snapshot->flips;
+    progress.exploitable    = snapshot->exploitable;
+    progress.rows           = snapshot->rows;
+    progress.bytes_hammered = snapshot->bytes_hammered;
+    progress.median_ns      = snapshot->median_ns;
+    progress.runtime        = snapshot->runtime;
+    user_on_progress(&progress, user_arg);
+}
+
+
+int drammer_init(const char *logfile) {
+    if (initialized) return 0;
+
+    if (logfile) {
+        global_of = fopen(logfile, "w");
+        if (global_of == NULL) {
+            perror("Could not open log file");
+            return -1;
+        }
+        setvbuf(global_of, NULL, _IONBF, 0);
+    }
+
+    pattern_seed = get_ns();
+    print("[LIB] Pattern seed: %llu\n", (unsigned long long) pattern_seed);
+
+    ION_init();
+    if (ION_probe_caching() < 0) {     // only cached mappings on ARMv7
+        ION_fini();
+        if (global_of) fclose(global_of);
+        global_of = NULL;
+        return -1;
+    }
+
+    templates = new template_arena();
+    initialized = true;
+    return 0;
+}
+
+void drammer_fini(void) {
+    if (!initialized) return;
+
+    drammer_release();
+    delete templates;
+    templates = NULL;
+    flip_pattern.clear();
+    flip_allocation.clear();
+
+    for (auto pattern : pattern_pool) {
+        free((void *) pattern->name);
+        free(pattern->above);
+        free(pattern->victim);
+        free(pattern->below);
+        delete pattern;
+    }
+    pattern_pool.clear();
+    run_patterns.clear();
+
+    ION_fini();
+    if (global_of) fclose(global_of);
+    global_of = NULL;
+    initialized = false;
+}
+
+void drammer_set_callbacks(drammer_flip_cb on_flip, drammer_progress_cb on_progress, void *arg) {
+    user_on_flip     = on_flip;
+    user_on_progress = on_progress;
+    user_arg         = arg;
+}
+
+/* Use <hint> if it is a valid row size, detect it otherwise. The row size
+ * cannot change while an allocation is held. */
+int drammer_rowsize(int hint) {
+    if (!initialized) return -1;
+    if (chunks.size()) return hint == rowsize ? rowsize : -1;
+
+    if (VALID_ROWSIZES.count(hint)) {
+        rowsize = hint;
+    } else {
+        DL_reset();
+        DL_phase("rowsize");
+        rowsize = RS_autodetect();
+        DL_end();
+    }
+    print("[LIB] Row size: %d\n", rowsize);
+    return VALID_ROWSIZES.count(rowsize) ? rowsize : -1;
+}
+
+/* Allocate all ION chunks of at least <min_bytes> (4 rows if 0), within
+ * <seconds> if not 0. Adds to the current allocation and returns the number
+ * of bytes held. */
+int64_t drammer_allocate(int min_bytes, int seconds) {
+    if (!initialized || !VALID_ROWSIZES.count(rowsize)) return -1;
+    if (min_bytes <= 0) min_bytes = rowsize * 4;
+
+    DL_reset();
+    DL_budget("exhaust", seconds > 0 ? seconds : 0);
+    DL_phase("exhaust");
+    exhaust(chunks, min_bytes);
+    DL_end();
+
+    int64_t bytes = 0;
+    for (size_t i = 0; i < chunks.size(); i++) 
+        if (chunks.mapping[i]) bytes += chunks.len[i];
+    print("[LIB] Holding %zu chunks, %lld bytes\n", chunks.size(), (long long) bytes);
+    return bytes;
+}
+
+void drammer_release(void) {
+    if (!chunks.size()) return;
+
+    ION_clean_all(chunks);
+    allocation++;
+}
+
+/* Hammer the allocation with the given patterns (see templating.h for their
+ * names). Flips are added to the list and handed to the flip callback as they
+ * are found. Returns the number of new flips. */
+int drammer_template(const char **patterns, int count, const struct drammer_options *options) {
+    if (!initialized || !chunks.size() || !VALID_ROWSIZES.count(rowsize)) return -1;
+    if (patterns == NULL || count <= 0) return -1;
+
+    struct drammer_options defaults;
+    memset(&defaults, 0, sizeof(defaults));
+    if (options == NULL) options = &defaults;
+    if (options->offsets < TMPL_OFFSETS_PAGE || options->offsets > TMPL_OFFSETS_ALL) return -1;
+    if (options->batch < 0 || options->batch > TMPL_MAX_BATCH) return -1;
+
+    run_patterns.clear();
+    for (int i = 0; i < count; i++) {
+        struct pattern_t *pattern = get_pattern(patterns[i]);
+        if (pattern == NULL) {
+            print("[LIB] Invalid pattern: %s\n", patterns[i] ? patterns[i] : "(null)");
+            return -1;
+        }
+        run_patterns.push_back(pattern);
+    }
+
+    if (options->seed) pattern_seed = options->seed;
+    for (auto pattern : run_patterns) {
+        pattern->cur_use = 0;
+        pattern->generation = 0;
+        TMPL_fill_pattern(pattern);
+    }
+
+    struct tmpl_config cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.hammer_readcount = options->hammer_readcount > 0 ? options->hammer_readcount : DRAMMER_READCOUNT;
+    cfg.offsets          = options->offsets;
+    cfg.stratified       = options->stratified;
+    cfg.batch            = options->batch ? options->batch : 1;
+    cfg.keep_chunks      = true;
+    cfg.on_flip          = on_flip;
+    cfg.on_progress      = on_progress;
+
+    size_t before = templates->size();
+
+    DL_reset();
+    DL_budget("templating", options->seconds > 0 ? options->seconds : 0);
+    DL_phase("templating");
+    TMPL_run(chunks, *templates, run_patterns, cfg);
+    DL_end();
+
+    for (size_t i = before; i < templates->size(); i++) {
+        flip_pattern.push_back(run_patterns[templates->at(i)->pattern]->name);
+        flip_allocation.push_back(allocation);
+    }
+    return templates->size() - before;
+}
+
+int drammer_flip_count(void) {
+    if (!initialized) return -1;
+    return templates->size();
+}
+
+int drammer_get_flip(int index, struct drammer_flip *flip) {
+    if (!initialized || flip == NULL || index < 0 || (size_t) index >= templates->size()) return -1;
+
+    fill_flip(templates->at(index), flip_pattern[index], flip_allocation[index], flip);
+    return 0;
+}
+
+/* Stop the current phase as soon as possible. Safe to call from another
+ * thread or a signal handler. */
+void drammer_cancel(void) {
+    DL_cancel();
+}
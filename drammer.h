@@ -0,0 +1,83 @@
+/*
+ * Copyright 2016, Victor van der Veen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef __DRAMMER_H__
+#define __DRAMMER_H__
+
+/* libdrammer: the templating core of rh-test as a library with a C API, so
+ * that an app can run tests in-process and keep its allocations between
+ * tests. The library has a single global state: one allocation, one row size
+ * and one list of flips. Calls are not thread-safe, except for
+ * drammer_cancel(). Functions return a negative value on error. */
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct drammer_flip {
+    uint64_t phys_addr;       // physical address of the flipped byte (0 without pagemap)
+    uintptr_t virt_addr;      // its virtual address, 0 once the allocation is released
+    uint32_t chunk;           // ION chunk holding the byte and its offset in there
+    uint32_t rel_address;
+    uint8_t org_byte;         // value written and value read back
+    uint8_t new_byte;
+    int bit;                  // flipped bit in the 32-bit word holding the byte
+    int one_to_zero;
+    int exploitable;          // usable for Drammer's page table attack
+    const char *pattern;      // name of the pattern that flipped it
+    uint32_t found_at;        // time(NULL)
+};
+
+struct drammer_progress {
+    int flips;
+    int exploitable;
+    int rows;                 // rows hammered by the current test
+    int64_t bytes_hammered;
+    int median_ns;            // median read time of the current test
+    int runtime;              // seconds since the current test started
+};
+
+struct drammer_options {
+    int seconds;              // templating budget, 0 to hammer all allocated rows
+    int hammer_readcount;     // reads per hammer round, 0 for the default (1000000)
+    int offsets;              // 0: every page, 1: one offset per bank mapping, 2: every 64 bytes
+    int stratified;           // hammer a stratified random sample of the rows
+    int batch;                // rows in different banks per round, 0 or 1 for one at a time
+    uint64_t seed;            // seed for random patterns, 0 to keep the current one
+};
+
+typedef void (*drammer_flip_cb)(const struct drammer_flip *flip, void *arg);
+typedef void (*drammer_progress_cb)(const struct drammer_progress *progress, void *arg);
+
+int     drammer_init(const char *logfile);
+void    drammer_fini(void);
+void    drammer_set_callbacks(drammer_flip_cb on_flip, drammer_progress_cb on_progress, void *arg);
+int     drammer_rowsize(int rowsize);
+int64_t drammer_allocate(int min_bytes, int seconds);
+void    drammer_release(void);
+int     drammer_template(const char **patterns, int count, const struct drammer_options *options);
+int     drammer_flip_count(void);
+int     drammer_get_flip(int index, struct drammer_flip *flip);
+void    drammer_cancel(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __DRAMMER_H__
@@ -58,10 +58,20 @@ static inline uint64_t get_ms(void) {
     return MILLION * (uint64_t) tv.tv_sec + tv.tv_usec;
 }
 
+/* Evict a cache line. ARMv7 has no unprivileged cache maintenance, there we
+ * rely on ION handing out uncached memory. */
+static inline void clflush(volatile void *p) {
+#if defined(__x86_64__) || defined(__i386__)
+    asm volatile("clflush (%0)" :: "r" (p) : "memory");
+#elif defined(__aarch64__)
+    asm volatile("dc civac, %0" :: "r" (p) : "memory");
+#endif
+}
+
 static int pagemap_fd = 0;
 static bool got_pagemap = true;
 
-static inline uintptr_t get_phys_addr(uintptr_t virtual_addr) {
+static inline uint64_t get_phys_addr(uintptr_t virtual_addr) {
     if (!got_pagemap) return 0;
     if (pagemap_fd == 0) {
         pagemap_fd = open("/proc/self/pagemap", O_RDONLY);
@@ -77,7 +87,7 @@ static inline uintptr_t get_phys_addr(uintptr_t virtual_addr) {
   
     // Check the "page present" flag.
     if ((value & (1ULL << 63)) == 0) {
-        printf("page not present? virtual address: %p | value: %p\n", virtual_addr, value);
+        printf("page not present? virtual address: %p | value: 0x%llx\n", (void *) virtual_addr, (unsigned long long) value);
         return 0;
     }
 
@@ -85,6 +95,28 @@ static inline uintptr_t get_phys_addr(uintptr_t virtual_addr) {
     return (frame_num * PAGESIZE) | (virtual_addr & (PAGESIZE-1));
 }
 
+/* splitmix64 (Steele, Lea and Flood) used as a counter-based generator: the
+ * output for index i only depends on (key, i), so fills vectorize and any
+ * stream can be regenerated exactly from its key. */
+#define SPLITMIX_GAMMA 0x9e3779b97f4a7c15ULL
+static inline uint64_t splitmix64(uint64_t x) {
+    x += SPLITMIX_GAMMA;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static inline void fill_random(uint8_t *buf, int len, uint64_t key) {
+    uint64_t *words = (uint64_t *) buf;
+    int nwords = len / sizeof(uint64_t);
+    for (int i = 0; i < nwords; i++) {
+        words[i] = splitmix64(key + (uint64_t) i * SPLITMIX_GAMMA);
+    }
+    for (int i = nwords * sizeof(uint64_t); i < len; i++) {
+        buf[i] = (uint8_t) splitmix64(key + (uint64_t) i * SPLITMIX_GAMMA);
+    }
+}
+
 static inline uint64_t compute_median(std::vector<uint64_t> &v) {
     if (v.size() == 0) return 0;
     std::vector<uint64_t> tmp = v;
@@ -93,11 +125,16 @@ static inline uint64_t compute_median(std::vector<uint64_t> &v) {
     return tmp[n];
 }
 
+/* A va_list can only be consumed once on x86-64 and aarch64, so the output
+ * file gets its own copy. */
+static inline void print(const char *format, ...) __attribute__((format(printf, 1, 2)));
 static inline void print(const char *format, ...) {
-    va_list args;
+    va_list args, args_of;
     va_start(args, format);
+    va_copy(args_of, args);
     vfprintf(stdout, format, args);
-    if (global_of != NULL) vfprintf(global_of, format, args);
+    if (global_of != NULL) vfprintf(global_of, format, args_of);
+    va_end(args_of);
     va_end(args);
 }
 
@@ -15,6 +15,7 @@
  */
 
 #include <assert.h>
+#include <dirent.h>
 #include <fcntl.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -25,17 +26,22 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <map>
 #include <numeric>
 #include <sstream>
+#include <string>
 #include <vector>
 
 #include <linux/ion.h>
 
+#include "cache.h"
+#include "deadline.h"
 #include "helper.h"
 #include "ion.h"
+#include "memwatch.h"
 
 int chipset;
 #define CHIPSET_MSM         21
@@ -49,13 +55,48 @@ int chipset;
 #define CHIPSET_QCT         22
 
 int ion_fd;
+int ion_flags = 0;      // allocation flags, chosen by ION_probe_caching()
+bool ion_cached = false; // whether our chunks are mapped cached
+bool ion_dma_heap = false; // allocating from DMA-BUF heaps instead of /dev/ion
 extern int rowsize;
 
+/* Linux 5.11 removed ION (and 4.12 changed its ABI). Its successor exposes
+ * one device per heap in /dev/dma_heap, where an allocation returns a dma-buf
+ * fd right away. With DMA-BUF heaps, a handle is that fd: sharing it returns
+ * the handle itself and freeing it closes it. Heap ids index the sorted heap
+ * names, so <chipset> still names our heap. Our NDK has no
+ * <linux/dma-heap.h>, so we carry the UAPI ourselves. */
+struct dma_heap_allocation_data {
+    uint64_t len;
+    uint32_t fd;
+    uint32_t fd_flags;
+    uint64_t heap_flags;
+};
+#define DMA_HEAP_IOC_MAGIC   'H'
+#define DMA_HEAP_IOCTL_ALLOC _IOWR(DMA_HEAP_IOC_MAGIC, 0x0, struct dma_heap_allocation_data)
+#define DMA_HEAP_DIR         "/dev/dma_heap"
+
+static std::vector<std::string> dma_heap_names;
+static std::vector<int> dma_heap_fds;
+
+static ion_user_handle_t dma_heap_alloc(int len, int heap_id, int flags) {
+    if (heap_id < 0 || heap_id >= (int) dma_heap_fds.size() || flags) return 0;
+    struct dma_heap_allocation_data allocation_data;
+    allocation_data.len = len;
+    allocation_data.fd = 0;
+    allocation_data.fd_flags = O_RDWR | O_CLOEXEC;
+    allocation_data.heap_flags = 0;
+    int err = ioctl(dma_heap_fds[heap_id], DMA_HEAP_IOCTL_ALLOC, &allocation_data);
+    if (err) return 0;
+    return allocation_data.fd;
+}
+
 /**********************************************
  * Core ION wrappers
  **********************************************/
-ion_user_handle_t ION_alloc(int len, int heap_id) {
+ion_user_handle_t ION_alloc(int len, int heap_id, int flags) {
     if (heap_id == -1 && len > M(4)) return 0;
+    if (ion_dma_heap) return dma_heap_alloc(len, heap_id == -1 ? chipset : heap_id, flags == -1 ? ion_flags : flags);
     struct ion_allocation_data allocation_data;
 
     if (heap_id == -1) {
@@ -63,7 +104,8 @@ ion_user_handle_t ION_alloc(int len, int heap_id) {
     } else {
         allocation_data.heap_id_mask = (0x1 << heap_id);
     }
-    allocation_data.flags = 0;
+    if (flags == -1) flags = ion_flags;
+    allocation_data.flags = flags;
     allocation_data.align = 0;
     allocation_data.len = len;
     int err = ioctl(ion_fd, ION_IOC_ALLOC, &allocation_data);
@@ -71,6 +113,7 @@ ion_user_handle_t ION_alloc(int len, int heap_id) {
     return allocation_data.handle;
 }
 int ION_share(ion_user_handle_t handle) {
+    if (ion_dma_heap) return handle;
     struct ion_fd_data fd_data;
     fd_data.handle = handle;
     int err = ioctl(ion_fd, ION_IOC_SHARE, &fd_data);
@@ -78,6 +121,7 @@ int ION_share(ion_user_handle_t handle) {
     return fd_data.fd;
 }
 int ION_free(ion_user_handle_t handle) {
+    if (ion_dma_heap) return close(handle);
     struct ion_handle_data handle_data;
     handle_data.handle = handle;
     int err = ioctl(ion_fd, ION_IOC_FREE, &handle_data);
@@ -119,7 +163,8 @@ void ION_clean(struct ion_data *data) {
         }
         data->mapping = NULL;
 
-        if (close(data->fd)) {
+        /* a dma-buf heap fd is the handle, closed by ION_free() below */
+        if (!ion_dma_heap && close(data->fd)) {
             perror("Could not close");
             exit(EXIT_FAILURE);
         }
@@ -134,6 +179,55 @@ void ION_clean(struct ion_data *data) {
     }
 }
 
+/**********************************************
+ * Table of ION chunks
+ **********************************************/
+struct ion_data ion_chunks::at(size_t i) const {
+    struct ion_data data;
+    data.handle  = handle[i];
+    data.fd      = fd[i];
+    data.len     = len[i];
+    data.mapping = mapping[i];
+    return data;
+}
+
+std::atomic<int64_t> ion_bytes_held(0);
+
+void ion_chunks::push_back(struct ion_data &data) {
+    uint64_t base = 0;
+    if (data.mapping) {
+        /* only trust the base if the last page follows the first one */
+        uint64_t first = get_phys_addr((uintptr_t) data.mapping);
+        uint64_t last  = get_phys_addr((uintptr_t) data.mapping + data.len - PAGESIZE);
+        if (first && last == first + data.len - PAGESIZE) base = first;
+    }
+    handle .push_back(data.handle);
+    fd     .push_back(data.fd);
+    len    .push_back(data.len);
+    mapping.push_back(data.mapping);
+    phys   .push_back(base);
+    order  .push_back(B_TO_ORDER(data.len));
+    ion_bytes_held += data.len;
+}
+
+void ion_chunks::erase_front(size_t n) {
+    handle .erase(handle .begin(), handle .begin() + n);
+    fd     .erase(fd     .begin(), fd     .begin() + n);
+    len    .erase(len    .begin(), len    .begin() + n);
+    mapping.erase(mapping.begin(), mapping.begin() + n);
+    phys   .erase(phys   .begin(), phys   .begin() + n);
+    order  .erase(order  .begin(), order  .begin() + n);
+}
+
+void ION_clean(struct ion_chunks &chunks, int i) {
+    struct ion_data data = chunks.at(i);
+    if (data.handle) ion_bytes_held -= data.len;
+    ION_clean(&data);
+    chunks.handle[i]  = 0;
+    chunks.fd[i]      = -1;
+    chunks.mapping[i] = NULL;
+}
+
 /**********************************************
  * Allocate ION chunks in bulk 
  **********************************************/
@@ -147,77 +241,88 @@ void lowmem_handler(int signal) {
     lowmem = true;
 }
 
-int ION_bulk(int len, std::vector<struct ion_data *> &chunks, int max, bool mmap) {
+int ION_bulk(int len, struct ion_chunks &chunks, int max, bool mmap) {
     lowmem = false;
     signal(SIGUSR1, lowmem_handler);
 
     int count = 0;
     while (true) {
-        struct ion_data *data = new ion_data;
-        if (data == NULL) {
-            perror("Could not malloc");
-            exit(EXIT_FAILURE);
-        }
+        struct ion_data data;
 
-        data->handle = ION_alloc(len);
-        if (data->handle == 0) {
+        /* stay within --max-mem and stop under memory pressure (see memwatch.h) */
+        if (!MEM_allows(len)) break;
+
+        data.handle = ION_alloc(len);
+        if (data.handle == 0) {
             /* Could not allocate, probably exhausted the ion chunks */
-            free(data);
             break;
         }
-        data->len = len;
+        data.len = len;
 
         if (mmap) {
-            int ret = ION_mmap(data);
+            int ret = ION_mmap(&data);
             if (ret < 0) {
+                ION_clean(&data);
                 break;
             }
-        } else {
-            data->mapping = NULL;
         }
     
-        data->hammerable_rows.clear();
-        
         chunks.push_back(data);
         count++;
         if (max > 0 && count >= max) break;
 
         if (lowmem) break;
+        if (DL_expired()) break;
     }
     return count;
 }
 
 /**********************************************
- * Clean a vector of struct ion_data
+ * Clean the first <max> chunks of a table
  **********************************************/
-void ION_clean_all(std::vector<struct ion_data *> &chunks, int max) {
+void ION_clean_all(struct ion_chunks &chunks, int max) {
     if (!max) max = chunks.size();
     for (int i = 0; i < max; i++) {
-        ION_clean(chunks[i]);
-        delete(chunks[i]);
+        ION_clean(chunks, i);
     }
-    chunks.erase(chunks.begin(), chunks.begin() + max); // remove first <max> elements
+    chunks.erase_front(max); // remove first <max> elements
 }
 
+
 /**********************************************
- * Populate a vector of virtual address that we can hammer
+ * Initialize and finalize /dev/ion
  **********************************************/
-void ION_get_hammerable_rows(struct ion_data * chunk) {
-    if (chunk->len < (3*rowsize)) return;
-    if (chunk->mapping == NULL) return;
-    for (int offset = rowsize; 
-             offset < chunk->len - rowsize; 
-             offset += rowsize) {
-        uintptr_t virt_row = (uintptr_t) chunk->mapping + offset;
-        chunk->hammerable_rows.push_back(virt_row);
+/* Open all DMA-BUF heaps and make <name> ours. Returns false if there are
+ * none or <name> is not among them. */
+static bool dma_heap_init(const char *name) {
+    DIR *dir = opendir(DMA_HEAP_DIR);
+    if (dir == NULL) return false;
+    for (struct dirent *entry; (entry = readdir(dir)) != NULL; ) {
+        if (entry->d_name[0] == '.') continue;
+        dma_heap_names.push_back(entry->d_name);
     }
-}
+    closedir(dir);
+    std::sort(dma_heap_names.begin(), dma_heap_names.end());
+
+    int ours = -1;
+    for (size_t i = 0; i < dma_heap_names.size(); i++) {
+        std::string path = std::string(DMA_HEAP_DIR) + "/" + dma_heap_names[i];
+        dma_heap_fds.push_back(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+        print("[ION] DMA-BUF heap %2d: %s%s\n", (int) i, dma_heap_names[i].c_str(), 
+                dma_heap_fds[i] < 0 ? " (can not open)" : "");
+        if (dma_heap_names[i] == name && dma_heap_fds[i] >= 0) ours = i;
+    }
+    if (ours < 0) return false;
 
+    ion_dma_heap = true;
+    chipset = ours;
+    print("[ION] Using DMA-BUF heap %d (%s)\n", chipset, name);
+    return true;
+}
 
-/**********************************************
- * Initialize and finalize /dev/ion
- **********************************************/
-void ION_init(void) {
+/* Picks the allocator at run time: /dev/ion if the kernel still has it, and
+ * DMA-BUF heap <dma_heap> otherwise, or if <dma_heap> is given explicitly. */
+void ION_init(const char *dma_heap) {
     // get chipset
     chipset = CHIPSET_MSM;
     std::ifstream cpuinfo("/proc/cpuinfo");
@@ -285,10 +390,12 @@ void ION_init(void) {
         }
     }
     
-    ion_fd = open("/dev/ion", O_RDONLY);
-    if (!ion_fd) {
-        perror("Could not open ion");
-        exit(EXIT_FAILURE);
+    ion_fd = dma_heap ? -1 : open("/dev/ion", O_RDONLY);
+    if (ion_fd < 0) {
+        if (!dma_heap_init(dma_heap ? dma_heap : ION_DMA_HEAP_DEFAULT)) {
+            fprintf(stderr, "Could not open /dev/ion or DMA-BUF heap %s\n", dma_heap ? dma_heap : ION_DMA_HEAP_DEFAULT);
+            exit(EXIT_FAILURE);
+        }
     }
     
     int err;
@@ -303,13 +410,124 @@ void ION_init(void) {
     setvbuf(stdout, NULL, _IONBF, 0);
 }
 void ION_fini(void) {
-    close(ion_fd);
+    if (ion_fd >= 0) close(ion_fd);
+    for (auto fd : dma_heap_fds) 
+        if (fd >= 0) close(fd);
+    dma_heap_fds.clear();
+    dma_heap_names.clear();
+}
+
+
+
+
+/**********************************************
+ * Determine whether ION mappings are cached
+ **********************************************/
+#define PROBE_LEN       K(64)
+#define PROBE_READCOUNT 100000
+#define UNCACHED_NS     25      // uncached reads take at least this long
+
+/* Whether an ION buffer is mapped cached depends on the heap, the allocation
+ * flags and the vendor kernel. We find out by timing reads from the same two
+ * words over and over: if they are served by the cache, this is an order of
+ * magnitude faster than going to DRAM. Returns -1 if the combination can not
+ * be allocated or mapped. */
+int probe_caching(int heap_id, int flags, uint64_t *read_ns) {
+    ion_user_handle_t handle = ION_alloc(PROBE_LEN, heap_id, flags);
+    if (handle == 0) return -1;
+
+    int ret = -1;
+    int fd = ION_share(handle);
+    if (fd >= 0) {
+        void *mapping = mmap(NULL, PROBE_LEN, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+        if (mapping != MAP_FAILED) {
+            volatile uintptr_t *virt1 = (volatile uintptr_t *) mapping;
+            volatile uintptr_t *virt2 = (volatile uintptr_t *) ((uintptr_t) mapping + PAGESIZE);
+            uint64_t t1 = get_ns();
+            for (int i = 0; i < PROBE_READCOUNT; i++) {
+                *virt1;
+                *virt2;
+            }
+            uint64_t t2 = get_ns();
+            *read_ns = (t2 - t1) / (PROBE_READCOUNT * 2);
+            munmap(mapping, PROBE_LEN);
+            ret = *read_ns < UNCACHED_NS;
+        }
+        if (!ion_dma_heap) close(fd);
+    }
+    ION_free(handle);
+    return ret;
 }
 
+/* Probe all heaps with and without ION_FLAG_CACHED and pick the flags for our
+ * own heap: hammering needs uncached memory. If our heap only gives us cached
+ * mappings, we flush the aggressors from the cache on every read instead.
+ * ARMv7 can not do that from userspace, so there every read would hit the
+ * cache: returns -1 if our heap can not be hammered, 0 otherwise. DMA-BUF
+ * heaps take no flags: whether they are cached is a property of the heap
+ * (e.g. system vs. system-uncached). */
+int ION_probe_caching(void) {
+    std::vector<int> flag_options = { 0, ION_FLAG_CACHED, ION_FLAG_CACHED | ION_FLAG_CACHED_NEEDS_SYNC };
+    int heaps = 32;
+    if (ion_dma_heap) {
+        flag_options = { 0 };
+        heaps = dma_heap_fds.size();
+    }
+    int uncached_flags = -1;
+    int cached_flags = -1;
+    for (int heap_id = 0; heap_id < heaps; heap_id++) {
+        for (auto flags : flag_options) {
+            uint64_t read_ns;
+            int cached = probe_caching(heap_id, flags, &read_ns);
+            if (cached < 0) continue;
+            print("[ION] heap %2d flags 0x%x: read %4llu ns | %s\n", 
+                    heap_id, flags, (unsigned long long) read_ns, cached ? "cached" : "uncached");
+            if (heap_id != chipset) continue;
+            if (!cached && uncached_flags == -1) uncached_flags = flags;
+            if ( cached &&   cached_flags == -1)   cached_flags = flags;
+        }
+    }
 
+    if (uncached_flags != -1) {
+        ion_flags = uncached_flags;
+        ion_cached = false;
+    } else if (cached_flags != -1) {
+        ion_flags = cached_flags;
+        ion_cached = true;
+#if defined(__arm__)
+        print("[ION] Heap %d is cached and we can not flush from userspace, hammering would hit the cache\n", chipset);
+        return -1;
+#else
+        print("[ION] Heap %d is cached, flushing aggressors while hammering\n", chipset);
+#endif
+    } else {
+        print("[ION] WARNING! Could not probe heap %d\n", chipset);
+        return 0;
+    }
+    print("[ION] Using heap %d with flags 0x%x (%s)\n", chipset, ion_flags, ion_cached ? "cached" : "uncached");
+    CACHE_init();
+    return 0;
+}
 
 
 void ION_detector(void) {
+    if (ion_dma_heap) {
+        int sizes[] = { K(4), M(4), M(16) };
+        for (int i = 0; i < (int) dma_heap_fds.size(); i++) {
+            for (auto len : sizes) {
+                printf("Trying to allocate %5d KB from DMA-BUF heap %2d (%s) ", len / 1024, i, dma_heap_names[i].c_str());
+                ion_user_handle_t handle = ION_alloc(len, i, 0);
+                if (handle == 0) {
+                    printf(" -> nope (%s)\n", strerror(errno));
+                    break;
+                }
+                printf(" -> ok!\n");
+                ION_free(handle);
+            }
+        }
+        return;
+    }
+
     for (int i = 0; i < 32; i++) {
         uint32_t mask = 0x1 << i;
         printf("Trying to allocate  4KB with heap id: %2d | mask: %8x ", i, mask);
@@ -18,6 +18,7 @@
 #ifndef __ION_H__
 #define __ION_H__
 
+#include <atomic>
 #include <map>
 #include <numeric>
 #include <set>
@@ -26,29 +27,70 @@
 #include <linux/ion.h>
 #include <strings.h>
 
+#include "helper.h"
+
 
 struct ion_data {
-    ion_user_handle_t handle;
-    int fd, len;
+    ion_user_handle_t handle = 0;
+    int fd = -1, len = 0;
     void *mapping = NULL;
+};
+
+/* The chunks of a bulk allocation, stored as one array per field so that
+ * walking all chunks stays in cache. Chunk <i> is handle[i], fd[i], len[i],
+ * etc. <phys> caches the physical address of the first byte of a chunk if it
+ * is mapped and physically contiguous, and is 0 otherwise. */
+struct ion_chunks {
+    std::vector<ion_user_handle_t> handle;
+    std::vector<int> fd;
+    std::vector<int> len;
+    std::vector<void *> mapping;
+    std::vector<uint64_t> phys;
+    std::vector<int> order;
 
-    std::vector<uintptr_t> hammerable_rows;
+    size_t size(void) const { return handle.size(); }
+    struct ion_data at(size_t i) const;
+    void push_back(struct ion_data &data);
+    void erase_front(size_t n);
 };
 
+/* The hammerable rows of a chunk are all its rows except for the first and
+ * the last one, so they can be computed instead of stored. */
+extern int rowsize;
+static inline int ION_rows(const struct ion_chunks &chunks, int i) {
+    if (chunks.mapping[i] == NULL || chunks.len[i] < 3 * rowsize) return 0;
+    return (chunks.len[i] - rowsize - 1) / rowsize;
+}
+static inline uintptr_t ION_row(const struct ion_chunks &chunks, int i, int row) {
+    return (uintptr_t) chunks.mapping[i] + (row + 1) * rowsize;
+}
+static inline uint64_t ION_row_phys(const struct ion_chunks &chunks, int i, int row) {
+    if (chunks.phys[i]) return chunks.phys[i] + (row + 1) * rowsize;
+    return get_phys_addr(ION_row(chunks, i, row));
+}
+
+
+
+extern std::atomic<int64_t> ion_bytes_held;    // bytes in all ion_chunks tables
+extern int ion_flags;
+extern bool ion_cached;
+extern bool ion_dma_heap;
 
+#define ION_DMA_HEAP_DEFAULT "system"
 
-ion_user_handle_t ION_alloc(int len, int heap_id = -1);
+ion_user_handle_t ION_alloc(int len, int heap_id = -1, int flags = -1);
 int  ION_share(ion_user_handle_t handle); 
 int  ION_free (ion_user_handle_t handle);
 
 int  ION_mmap (struct ion_data *data, int prot = -1, int flags = -1, void *addr = NULL);
 void ION_clean(struct ion_data *data);
-int  ION_bulk(int len, std::vector<struct ion_data *> &chunks, int max = 0, bool mmap = true);
-void ION_clean_all(    std::vector<struct ion_data *> &chunks, int max = 0);
-void ION_get_hammerable_rows(struct ion_data *chunk);
+void ION_clean(struct ion_chunks &chunks, int i);
+int  ION_bulk(int len, struct ion_chunks &chunks, int max = 0, bool mmap = true);
+void ION_clean_all(    struct ion_chunks &chunks, int max = 0);
 
 void ION_detector(void);
-void ION_init(void);
+int  ION_probe_caching(void);
+void ION_init(const char *dma_heap = NULL);
 void ION_fini(void);
 
 #endif
@@ -0,0 +1,361 @@
+/*
+ * Copyright 2016, Victor van der Veen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "deadline.h"
+#include "helper.h"
+#include "ion.h"
+#include "mapping.h"
+#include "templating.h"
+
+#define MAP_POOL_SIZE   1024        // random addresses to classify into banks
+#define MAP_READCOUNT   2000        // alternating reads per measurement
+#define MAP_MAX_SETS    64          // stop after finding this many bank sets
+#define MAP_MIN_SET     4           // ignore sets smaller than this
+#define MAP_BIT_SAMPLES 5           // pairs measured per address bit
+#define MAP_LOW_BIT     6           // cache line granularity
+#define MAP_MIN_BYTES   M(64)       // allocate anonymous memory below this
+
+struct dram_mapping dram_mapping;
+
+struct map_addr {
+    uint64_t phys;
+    volatile uintptr_t *virt;
+};
+
+/* Alternate reads between two addresses and return the average time of one
+ * pair of reads. If both addresses are in the same bank but in a different
+ * row, every read causes a row buffer conflict and this takes measurably
+ * longer. */
+uint64_t MAP_access_time(volatile uintptr_t *virt1, volatile uintptr_t *virt2, int readcount) {
+    uint64_t t1 = get_ns();
+    for (int i = 0; i < readcount; i++) {
+        *virt1;
+        *virt2;
+        clflush(virt1);
+        clflush(virt2);
+    }
+    uint64_t t2 = get_ns();
+    return (t2 - t1) / readcount;
+}
+
+int MAP_bank(uint64_t phys) {
+    int bank = 0;
+    for (int i = 0; i < dram_mapping.functions; i++) {
+        bank |= __builtin_parityll(phys & dram_mapping.function[i]) << i;
+    }
+    return bank;
+}
+
+uint64_t MAP_row(uint64_t phys) {
+    uint64_t row = 0;
+    int shift = 0;
+    for (int bit = 0; bit < 64; bit++) {
+        if (dram_mapping.row_mask & (1ULL << bit)) {
+            row |= ((phys >> bit) & 1) << shift;
+            shift++;
+        }
+    }
+    return row;
+}
+
+/* Interrupts only make a measurement slower, so take the best of two */
+uint64_t measure(volatile uintptr_t *virt1, volatile uintptr_t *virt2) {
+    return std::min(MAP_access_time(virt1, virt2, MAP_READCOUNT),
+                    MAP_access_time(virt1, virt2, MAP_READCOUNT));
+}
+
+/* Split row conflict times into 'fast' and 'slow' at the largest gap in the
+ * upper half of the sorted measurements: only a 1/#banks fraction of random
+ * pairs conflicts, so the slow cluster sits at the top. The slow cluster must
+ * hold at least 1/MAP_MAX_BANKS of the pairs, so that a few outliers do not
+ * end up as the slow cluster. */
+#define MAP_MAX_BANKS 128
+uint64_t find_threshold(std::vector<uint64_t> times) {
+    std::sort(times.begin(), times.end());
+    size_t n = times.size();
+    if (n < 2 * MAP_MAX_BANKS) return 0;
+
+    uint64_t best_gap = 0;
+    uint64_t threshold = 0;
+    for (size_t i = n / 2; i + 1 < n - n / MAP_MAX_BANKS; i++) {
+        uint64_t gap = times[i + 1] - times[i];
+        if (gap > best_gap) {
+            best_gap = gap;
+            threshold = (times[i] + times[i + 1]) / 2;
+        }
+    }
+    /* require a clear separation from the typical access time */
+    if (best_gap * 10 < times[n / 2]) return 0;
+    return threshold;
+}
+
+/* Basis of the null space over GF(2) of the vectors in <rows>, restricted to
+ * the bits in <columns>. These are exactly the XOR functions that evaluate to
+ * the same value for every pair of addresses in the same bank. */
+std::vector<uint64_t> null_space(std::vector<uint64_t> rows, uint64_t columns) {
+    std::vector<uint64_t> reduced;  // reduced row echelon form
+    std::vector<int> pivots;
+    for (int col = 63; col >= 0; col--) {
+        uint64_t bit = 1ULL << col;
+        if (!(columns & bit)) continue;
+
+        size_t r;
+        for (r = 0; r < rows.size(); r++) if (rows[r] & bit) break;
+        if (r == rows.size()) continue;
+        uint64_t pivot = rows[r];
+        rows.erase(rows.begin() + r);
+
+        for (auto &row : rows)    if (row & bit) row ^= pivot;
+        for (auto &row : reduced) if (row & bit) row ^= pivot;
+        reduced.push_back(pivot);
+        pivots.push_back(col);
+    }
+
+    std::vector<uint64_t> basis;
+    for (int col = 0; col < 64; col++) {
+        uint64_t bit = 1ULL << col;
+        if (!(columns & bit)) continue;
+        if (std::find(pivots.begin(), pivots.end(), col) != pivots.end()) continue;
+
+        uint64_t f = bit;
+        for (size_t r = 0; r < reduced.size(); r++) {
+            if (reduced[r] & bit) f |= 1ULL << pivots[r];
+        }
+        basis.push_back(f);
+    }
+    return basis;
+}
+
+/* Pick the lowest weight functions that span the same space as <basis>,
+ * which is how bank functions are usually documented. */
+std::vector<uint64_t> simplify(std::vector<uint64_t> &basis) {
+    std::vector<uint64_t> candidates;
+    int dim = basis.size();
+    for (uint32_t combo = 1; combo < (1U << dim); combo++) {
+        uint64_t f = 0;
+        for (int i = 0; i < dim; i++) if (combo & (1U << i)) f ^= basis[i];
+        candidates.push_back(f);
+    }
+    std::sort(candidates.begin(), candidates.end(), [](uint64_t a, uint64_t b) {
+        int pa = __builtin_popcountll(a), pb = __builtin_popcountll(b);
+        return pa != pb ? pa < pb : a < b;
+    });
+
+    std::vector<uint64_t> picked;
+    std::vector<uint64_t> echelon;  // to test linear independence
+    for (auto f : candidates) {
+        uint64_t v = f;
+        for (auto e : echelon) v = std::min(v, v ^ e);
+        if (v == 0) continue;
+        echelon.push_back(v);
+        std::sort(echelon.rbegin(), echelon.rend());
+        picked.push_back(f);
+        if ((int) picked.size() == dim) break;
+    }
+    return picked;
+}
+
+void print_bits(const char *what, uint64_t mask) {
+    print("[MAP] %s:", what);
+    for (int bit = 0; bit < 64; bit++) {
+        if (mask & (1ULL << bit)) print(" %d", bit);
+    }
+    print(" (0x%llx)\n", (unsigned long long) mask);
+}
+
+/* Reverse engineer the DRAM address mapping, similar to DRAMA (Pessl et al.,
+ * USENIX Security 2016):
+ * 1. take a pool of random cache lines from the allocation;
+ * 2. partition the pool into sets of addresses that cause row conflicts with
+ *    each other, i.e., that are in the same bank but in different rows;
+ * 3. solve for the XOR functions that are constant within every set;
+ * 4. classify each address bit as a row bit if flipping it (while keeping
+ *    the bank the same) causes a row conflict.
+ * We need physical addresses for this, so /proc/self/pagemap must work. If
+ * there is not enough ION memory (e.g., on a Linux host without /dev/ion), we
+ * probe anonymous memory instead. */
+int MAP_detect(struct ion_chunks &chunks) {
+    dram_mapping.valid = false;
+    dram_mapping.functions = 0;
+
+    std::unordered_map<uint64_t, uintptr_t> pages; // physical page -> virtual page
+    size_t bytes = 0;
+    for (size_t i = 0; i < chunks.size(); i++) {
+        if (chunks.mapping[i] == NULL) continue;
+        bytes += chunks.len[i];
+    }
+
+    void *anon = NULL;
+    size_t anon_len = 0;
+    if (bytes < MAP_MIN_BYTES) {
+        anon_len = MAP_MIN_BYTES;
+        print("[MAP] Only %d KB of ION memory, probing %d MB of anonymous memory\n", (int) (bytes / 1024), (int) (anon_len / 1024 / 1024));
+        anon = mmap(NULL, anon_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+        if (anon == MAP_FAILED) {
+            perror("Could not mmap");
+            return -1;
+        }
+        for (size_t offset = 0; offset < anon_len; offset += PAGESIZE) {
+            uintptr_t virt = (uintptr_t) anon + offset;
+            *(volatile uint8_t *) virt = 0;
+            uint64_t phys = get_phys_addr(virt);
+            if (phys) pages[phys] = virt;
+        }
+    } else {
+        for (size_t i = 0; i < chunks.size(); i++) {
+            if (chunks.mapping[i] == NULL) continue;
+            for (int offset = 0; offset < chunks.len[i]; offset += PAGESIZE) {
+                uintptr_t virt = (uintptr_t) chunks.mapping[i] + offset;
+                uint64_t phys = chunks.phys[i] ? chunks.phys[i] + offset : get_phys_addr(virt);
+                if (phys) pages[phys] = virt;
+            }
+        }
+    }
+    if (pages.size() < MAP_POOL_SIZE) {
+        print("[MAP] Not enough physical addresses (is pagemap readable?), giving up\n");
+        goto bail;
+    }
+    print("[MAP] Collected %d pages\n", (int) pages.size());
+
+    {
+        /* 1. pool of random cache lines */
+        std::vector<uint64_t> page_list;
+        uint64_t varying = 0;
+        for (auto &it : pages) page_list.push_back(it.first);
+        std::sort(page_list.begin(), page_list.end());
+
+        uint64_t state = splitmix64(pattern_seed ^ 0x4d4150ULL);
+        std::vector<struct map_addr> pool;
+        for (int i = 0; i < MAP_POOL_SIZE; i++) {
+            state = splitmix64(state);
+            uint64_t page = page_list[state % page_list.size()];
+            uint64_t line = ((state >> 32) % (PAGESIZE >> MAP_LOW_BIT)) << MAP_LOW_BIT;
+            pool.push_back({ page + line, (volatile uintptr_t *) (pages[page] + line) });
+            varying |= (page + line) ^ pool[0].phys;
+        }
+        varying &= ~((1ULL << MAP_LOW_BIT) - 1);
+
+        /* 2. threshold and bank sets */
+        std::vector<uint64_t> times;
+        for (size_t i = 1; i < pool.size(); i++)
+            times.push_back(measure(pool[0].virt, pool[i].virt));
+        uint64_t threshold = find_threshold(times);
+        print("[MAP] Median access time: %llu ns, conflict threshold: %llu ns\n", (unsigned long long) compute_median(times), (unsigned long long) threshold);
+        if (threshold == 0) {
+            print("[MAP] No row conflicts observed, giving up\n");
+            goto bail;
+        }
+
+        std::vector<uint64_t> diffs;
+        std::vector<size_t> remaining;
+        for (size_t i = 0; i < pool.size(); i++) remaining.push_back(i);
+        int sets = 0;
+        while (remaining.size() > MAP_MIN_SET && sets < MAP_MAX_SETS) {
+            if (DL_expired()) {
+                print("[MAP] Out of time, giving up\n");
+                goto bail;
+            }
+            struct map_addr &base = pool[remaining[0]];
+            std::vector<size_t> members, others;
+            for (size_t i = 1; i < remaining.size(); i++) {
+                struct map_addr &other = pool[remaining[i]];
+                if (measure(base.virt, other.virt) > threshold)
+                    members.push_back(remaining[i]);
+                else
+                    others.push_back(remaining[i]);
+            }
+            if (members.size() + 1 >= MAP_MIN_SET) {
+                for (auto m : members) diffs.push_back((pool[m].phys ^ base.phys) & varying);
+                sets++;
+                remaining = others;
+            } else {
+                others.insert(others.end(), members.begin(), members.end());
+                remaining = others;
+            }
+        }
+        print("[MAP] Found %d bank sets with %d conflicting pairs\n", sets, (int) diffs.size());
+
+        /* 3. bank functions */
+        std::vector<uint64_t> basis = null_space(diffs, varying);
+        if (basis.empty() || basis.size() > MAP_MAX_FUNCTIONS) {
+            print("[MAP] Could not solve bank functions (%d candidates)\n", (int) basis.size());
+            goto bail;
+        }
+        std::vector<uint64_t> functions = simplify(basis);
+        dram_mapping.functions = functions.size();
+        for (size_t i = 0; i < functions.size(); i++) {
+            dram_mapping.function[i] = functions[i];
+            char what[32];
+            snprintf(what, sizeof(what), "bank function %d", (int) i);
+            print_bits(what, functions[i]);
+        }
+
+        /* 4. row and column bits */
+        dram_mapping.row_mask = 0;
+        dram_mapping.column_mask = 0;
+        for (int bit = MAP_LOW_BIT; bit < 64; bit++) {
+            uint64_t flip = 1ULL << bit;
+            if (!(varying & flip)) continue;
+
+            /* compensate with the lowest other bit of each function that
+             * uses this bit, so that the bank stays the same */
+            uint64_t delta = flip;
+            bool in_function = false;
+            for (auto f : functions) {
+                if (!(f & flip)) continue;
+                in_function = true;
+                uint64_t rest = f & ~flip;
+                if (rest) delta ^= rest & -rest;
+            }
+            bool same_bank = true;
+            for (auto f : functions)
+                if (__builtin_parityll(delta & f)) same_bank = false;
+            if (!same_bank) continue;
+
+            int conflicts = 0, samples = 0;
+            for (size_t i = 0; i < pool.size() && samples < MAP_BIT_SAMPLES; i++) {
+                uint64_t other = pool[i].phys ^ delta;
+                auto it = pages.find(other & ~((uint64_t) PAGESIZE - 1));
+                if (it == pages.end()) continue;
+                volatile uintptr_t *virt = (volatile uintptr_t *) (it->second + (other & (PAGESIZE - 1)));
+                if (measure(pool[i].virt, virt) > threshold) conflicts++;
+                samples++;
+            }
+            if (samples == 0) continue;
+            if (conflicts * 2 > samples) dram_mapping.row_mask    |= flip;
+            else if (!in_function)      dram_mapping.column_mask |= flip;
+        }
+        print_bits("row bits", dram_mapping.row_mask);
+        print_bits("column bits", dram_mapping.column_mask);
+        print("[MAP] %d banks\n", 1 << dram_mapping.functions);
+
+        dram_mapping.valid = dram_mapping.row_mask != 0;
+    }
+
+bail:
+    if (anon) munmap(anon, anon_len);
+    return dram_mapping.valid ? 0 : -1;
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright 2016, Victor van der Veen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __MAPPING_H__
+#define __MAPPING_H__
+
+#include <vector>
+
+#include <stdint.h>
+
+#include "ion.h"
+
+#define MAP_MAX_FUNCTIONS 8
+
+/* DRAM address mapping as recovered by MAP_detect(): the bank (including rank
+ * and channel) is selected by the parity of the physical address bits in each
+ * of the XOR <function> masks, the row by the bits in <row_mask>. */
+struct dram_mapping {
+    bool valid;
+    int functions;
+    uint64_t function[MAP_MAX_FUNCTIONS];
+    uint64_t row_mask;
+    uint64_t column_mask;
+};
+
+extern struct dram_mapping dram_mapping;
+
+int      MAP_detect(struct ion_chunks &chunks);
+int      MAP_bank(uint64_t phys);
+uint64_t MAP_row(uint64_t phys);
+uint64_t MAP_access_time(volatile uintptr_t *virt1, volatile uintptr_t *virt2, int readcount);
+
+#endif // __MAPPING_H__
@@ -31,20 +31,16 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "deadline.h"
 #include "helper.h"
 #include "ion.h"
 #include "massage.h"
+#include "memwatch.h"
 #include "rowsize.h"
 #include "templating.h"
 
 extern bool lowmem;
 
-bool alloc_timeout;
-void alloc_alarm(int signal) {
-    printf("Allocation timeout\n");
-    alloc_timeout = true;
-}
-
 std::ifstream meminfo("/proc/meminfo");
 size_t read_meminfo(std::string type) {
     meminfo.clear();
@@ -59,7 +55,7 @@ size_t read_meminfo(std::string type) {
 }
 size_t get_LowFree(void) { return read_meminfo("LowFree"); }
 
-int exhaust(std::vector<struct ion_data *> &chunks, int min_bytes, bool mmap) { 
+int exhaust(struct ion_chunks &chunks, int min_bytes, bool mmap) { 
     int total_kb;
 
     total_kb = 0;
@@ -79,9 +75,6 @@ int exhaust(std::vector<struct ion_data *> &chunks, int min_bytes, bool mmap) {
 
 
 
-/* stop defrag when it has been working for more than ALLOC_TIMEOUT seconds */
-#define ALLOC_TIMEOUT 10
-
 /* stop defrag when the system has less than MIN_LOWFREE KB low memory left */
 #define MIN_LOWFREE 4 * 1024
 
@@ -99,15 +92,15 @@ int exhaust(std::vector<struct ion_data *> &chunks, int min_bytes, bool mmap) {
  * background processes are already forced to use smaller contiguous memory
  * chunks (up to 32KB). Since we cannot simply exhaust *all* 4KB chunks (we
  * would go completely out of memory), we then allocate chunks until:
- * - a timeout occurs (after ALLOC_TIMEOUT seconds); or
+ * - the budget of the defrag phase is used up (see -d and deadline.h); or
  * - the system has little free low memory left (MIN_LOWFREE KB); or
+ * - we reached --max-mem or the watchdog reports memory pressure; or
  * - we did not get many new blocks during the last x seconds (INTERAL /
  *   MINCOUNT)
  */
-void defrag(int alloc_timer) {
-    std::vector<struct ion_data *> defrag_chunks;
+void defrag(void) {
+    struct ion_chunks defrag_chunks;
     
-    time_t start_time = 0;
     time_t  prev_time = 0;
     int      count = 0;
     int prev_count = 0;
@@ -120,33 +113,32 @@ void defrag(int alloc_timer) {
 
     if (lowmem) goto bail;
 
-    alloc_timeout = false;
-    signal(SIGALRM, alloc_alarm);
-    alarm(alloc_timer);
-    
-    start_time = time(NULL);
-
     while (true) {
-        struct ion_data *data = new ion_data;
-        if (data == NULL) {
-            perror("Could not allocate memory");
-            exit(EXIT_FAILURE);
+        if (DL_expired()) {
+            print("[DEFRAG] Timeout\n");
+            break;
+        }
+        if (!MEM_allows(len)) {
+            print("[DEFRAG] Memory cap reached or memory pressure\n");
+            break;
         }
-        data->handle = ION_alloc(len);
-        if (data->handle == 0) {
+
+        struct ion_data data;
+        data.handle = ION_alloc(len);
+        if (data.handle == 0) {
             printf("Exhausted *all* memory?\n");
             break;
 //          exit(EXIT_FAILURE);
         }
-        data->len = len;
-        data->mapping = NULL;
+        data.len = len;
         count++;
+        defrag_chunks.push_back(data);
 
         time_t curr_time = time(NULL);
         if (curr_time != prev_time) {
             int lowfree = get_LowFree();
-            int timerunning = (curr_time - start_time);
-            int timeleft = alloc_timer - timerunning;
+            uint64_t remaining = DL_remaining_ns();
+            int timeleft = (remaining == UINT64_MAX) ? -1 : remaining / 1000000000ULL;
 
             alloc_count[alloc_count_index] = (count - prev_count);
             alloc_count_index = (alloc_count_index + 1) % 10;
@@ -170,16 +162,10 @@ void defrag(int alloc_timer) {
                 print("[DEFRAG] Not enough low memory\n");
                 break;
             }
-
-            if (alloc_timeout) {
-                print("[DEFRAG] Timeout\n");
-                break;
-            }
             
             prev_count = count;
             prev_time = curr_time;
         }
-        defrag_chunks.push_back(data);
     }
    
     print("[DEFRAG] Additionally got %d chunks of size %d KB (%d bytes in total = %d MB)\n", 
@@ -0,0 +1,175 @@
+/*
+ * Copyright 2016, Victor van der Veen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <algorithm>
+#include <atomic>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "helper.h"
+#include "ion.h"
+#include "memwatch.h"
+
+std::atomic<bool>    mem_pressure(false);
+std::atomic<int64_t> mem_release(0);
+std::atomic<int>     mem_avail_kb(0);
+std::atomic<int>     mem_psi(-1);
+std::atomic<int>     mem_rss_kb(0);
+std::atomic<int>     mem_vmas(0);
+
+/* Under PSI pressure, ask for this share of the memory we hold. PSI avg10 is
+ * an average over 10 seconds, so it stays high for a while after we gave
+ * memory back: we ask again at most once per MEM_PSI_WINDOW_MS. */
+#define MEM_PSI_SHARE     8
+#define MEM_PSI_WINDOW_MS 10000
+
+static struct mem_config mem_cfg;
+static uint64_t psi_asked_ns;       // when we last asked for memory because of PSI
+static std::atomic<bool> running(false);
+static pthread_t watchdog;
+
+/* Returns the value in kB of <key> in a /proc file in meminfo format, or -1 */
+static int read_kb(const char *path, const char *key) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return -1;
+    char line[256];
+    int kb = -1;
+    size_t len = strlen(key);
+    while (fgets(line, sizeof(line), f)) {
+        if (!strncmp(line, key, len) && line[len] == ':') {
+            kb = atoi(line + len + 1);
+            break;
+        }
+    }
+    fclose(f);
+    return kb;
+}
+
+/* "some avg10=1.23 avg60=..." in 1/100 %, or -1 if the kernel has no PSI */
+static int read_psi(void) {
+    FILE *f = fopen("/proc/pressure/memory", "r");
+    if (f == NULL) return -1;
+    float avg10;
+    int psi = -1;
+    if (fscanf(f, "some avg10=%f", &avg10) == 1) psi = avg10 * 100;
+    fclose(f);
+    return psi;
+}
+
+static int count_vmas(void) {
+    FILE *f = fopen("/proc/self/maps", "r");
+    if (f == NULL) return -1;
+    int count = 0;
+    for (int c; (c = fgetc(f)) != EOF; ) 
+        if (c == '\n') count++;
+    fclose(f);
+    return count;
+}
+
+static void sample(void) {
+    int avail = read_kb("/proc/meminfo", "MemAvailable");
+    if (avail < 0) avail = read_kb("/proc/meminfo", "MemFree");
+    mem_avail_kb = avail;
+    mem_psi      = read_psi();
+    mem_rss_kb   = read_kb("/proc/self/status", "VmRSS");
+    mem_vmas     = count_vmas();
+
+    int64_t held = ion_bytes_held;
+    int64_t want = 0;
+    if (mem_cfg.max_bytes && held > mem_cfg.max_bytes) 
+        want = held - mem_cfg.max_bytes;
+    bool low  = mem_cfg.min_free_kb && avail >= 0 && avail < mem_cfg.min_free_kb;
+    bool psi  = mem_cfg.max_psi && mem_psi > mem_cfg.max_psi * 100;
+    if (low) want = std::max(want, (int64_t) (mem_cfg.min_free_kb - avail) * 1024);
+    if (psi && get_ns() - psi_asked_ns >= MEM_PSI_WINDOW_MS * 1000000ULL) {
+        want = std::max(want, held / MEM_PSI_SHARE);
+        psi_asked_ns = get_ns();
+    }
+    want = std::min(want, held);
+
+    if ((low || psi) != mem_pressure) {
+        print("[MEM] %s | available: %d MB | psi: %.2f%% | held: %lld MB\n", 
+                (low || psi) ? "Memory pressure, releasing chunks" : "Pressure gone",
+                avail / 1024, mem_psi / 100.0, (long long) (held >> 20));
+    }
+    mem_pressure = low || psi;
+
+    int64_t pending = mem_release;
+    while (want > pending && !mem_release.compare_exchange_weak(pending, want)) {}
+}
+
+static void *watchdog_thread(void *arg) {
+    while (running) {
+        sample();
+        usleep(mem_cfg.interval_ms * 1000);
+    }
+    return NULL;
+}
+
+/* The watchdog only runs if a limit is configured: without one, it would
+ * just add background work while we hammer. Returns whether it runs. */
+bool MEM_start(struct mem_config &cfg) {
+    mem_cfg = cfg;
+    if (!cfg.max_bytes && !cfg.min_free_kb && !cfg.max_psi) {
+        MEM_report("start");
+        return false;
+    }
+    psi_asked_ns = 0;
+    sample();
+    print("[MEM] cap: %lld MB | min free: %d MB | max psi: %d%% | available: %d MB | psi: %s\n", 
+            (long long) (mem_cfg.max_bytes >> 20), mem_cfg.min_free_kb / 1024, mem_cfg.max_psi, 
+            mem_avail_kb / 1024, mem_psi < 0 ? "n/a" : "yes");
+    MEM_report("start");
+
+    running = true;
+    if (pthread_create(&watchdog, NULL, watchdog_thread, NULL)) {
+        perror("Could not start memory watchdog");
+        running = false;
+    }
+    return running;
+}
+
+void MEM_stop(void) {
+    if (!running) return;
+    running = false;
+    pthread_join(watchdog, NULL);
+}
+
+/* May we allocate another <len> bytes of ION memory? */
+bool MEM_allows(int len) {
+    if (mem_pressure) return false;
+    return !mem_cfg.max_bytes || ion_bytes_held + len <= mem_cfg.max_bytes;
+}
+
+/* <bytes> were given back on request of the watchdog */
+void MEM_released(int64_t bytes) {
+    int64_t pending = mem_release;
+    while (!mem_release.compare_exchange_weak(pending, std::max((int64_t) 0, pending - bytes))) {}
+}
+
+/* our own footprint: resident memory and memory mappings (ION chunks are
+ * mapped one by one, so the VMA count grows with the allocation) */
+void MEM_report(const char *when) {
+    mem_rss_kb = read_kb("/proc/self/status", "VmRSS");
+    mem_vmas   = count_vmas();
+    print("[MEM] Footprint (%s): RSS: %d KB | VMAs: %d | ION held: %lld KB\n", 
+            when, (int) mem_rss_kb, (int) mem_vmas, (long long) (ion_bytes_held >> 10));
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright 2016, Victor van der Veen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef __MEMWATCH_H__
+#define __MEMWATCH_H__
+
+#include <atomic>
+
+#include <stdint.h>
+
+struct mem_config {
+    int64_t max_bytes;     // cap on the ION memory we hold, 0 for no cap
+    int min_free_kb;       // release memory while MemAvailable is below this, 0 to ignore
+    int max_psi;           // release memory while memory PSI (some avg10, %) is above this, 0 to ignore
+    int interval_ms;       // time between two samples
+};
+
+/* Latest sample of the watchdog thread. <mem_release> is the number of bytes
+ * it wants us to give back; the thread never frees chunks itself, as they may
+ * be hammered at that moment, so TMPL_run() releases them between rows. */
+extern std::atomic<bool>    mem_pressure;    // stop allocating
+extern std::atomic<int64_t> mem_release;
+extern std::atomic<int>     mem_avail_kb;    // MemAvailable (MemFree on old kernels)
+extern std::atomic<int>     mem_psi;         // some avg10 in 1/100 %, -1 without PSI
+extern std::atomic<int>     mem_rss_kb;      // our resident set size
+extern std::atomic<int>     mem_vmas;        // our number of memory mappings
+
+bool MEM_start(struct mem_config &cfg);
+void MEM_stop(void);
+bool MEM_allows(int len);
+void MEM_released(int64_t bytes);
+void MEM_report(const char *when);
+
+#endif // __MEMWATCH_H__
@@ -0,0 +1,185 @@
+/*
+ * Copyright 2016, Victor van der Veen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <atomic>
+#include <string>
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "helper.h"
+#include "ion.h"
+#include "memwatch.h"
+#include "metrics.h"
+
+#define MET_INTERVAL_MS 1000
+#define MET_SOCKET_PREFIX "unix:"
+
+/* The snapshot is written by the main thread once per row (and on phase
+ * changes) and published by a separate thread, either by atomically replacing
+ * a file or by answering connections on a Unix socket, so that the hammer loop
+ * never waits for a reader. */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct met_snapshot current;
+static const char *phase = "init";
+static time_t updated;
+
+static std::string path;
+static int listen_fd = -1;
+static std::atomic<bool> running(false);
+static pthread_t publisher;
+
+static int format(char *buf, size_t len) {
+    pthread_mutex_lock(&lock);
+    struct met_snapshot s = current;
+    const char *p = phase;
+    time_t t = updated;
+    pthread_mutex_unlock(&lock);
+
+    double rows_per_s = s.runtime > 0 ? (double) s.rows / s.runtime : 0.0;
+    return snprintf(buf, len, 
+            "{\"pid\":%d,\"updated\":%ld,\"phase\":\"%s\",\"flips\":%d,\"exploitable\":%d,"
+            "\"rows\":%d,\"rows_per_s\":%.2f,\"bytes_hammered\":%lld,\"median_ns\":%d,"
+            "\"row_median_ns\":%d,\"row_p90_ns\":%d,\"runtime\":%d,\"memory_held\":%lld,"
+            "\"rss_kb\":%d,\"vmas\":%d}\n",
+            getpid(), (long) t, p, s.flips, s.exploitable, 
+            s.rows, rows_per_s, (long long) s.bytes_hammered, s.median_ns, 
+            s.row_median_ns, s.row_p90_ns, s.runtime, (long long) ion_bytes_held,
+            (int) mem_rss_kb, (int) mem_vmas);
+}
+
+/* write to <path>.tmp and rename, so readers never see a partial snapshot */
+static void write_file(void) {
+    char buf[1024];
+    int len = format(buf, sizeof(buf));
+    std::string tmp = path + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "w");
+    if (f == NULL) return;
+    fwrite(buf, 1, len, f);
+    fclose(f);
+    rename(tmp.c_str(), path.c_str());
+}
+
+static void serve(void) {
+    struct pollfd pfd = { listen_fd, POLLIN, 0 };
+    if (poll(&pfd, 1, MET_INTERVAL_MS) <= 0) return;
+
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) return;
+    char buf[1024];
+    int len = format(buf, sizeof(buf));
+    if (write(fd, buf, len) != len) { /* reader went away */ }
+    close(fd);
+}
+
+static void *publisher_thread(void *arg) {
+    while (running) {
+        if (listen_fd >= 0) {
+            serve();
+        } else {
+            write_file();
+            usleep(MET_INTERVAL_MS * 1000);
+        }
+    }
+    return NULL;
+}
+
+static int open_socket(const char *name) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(name) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", name);
+        return -1;
+    }
+    strcpy(addr.sun_path, name);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("Could not create metrics socket");
+        return -1;
+    }
+    unlink(name);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) || listen(fd, 4)) {
+        perror("Could not bind metrics socket");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* <target> is a file name, or unix:<path> to serve snapshots on a socket */
+void MET_start(const char *target) {
+    if (strncmp(target, MET_SOCKET_PREFIX, strlen(MET_SOCKET_PREFIX)) == 0) {
+        path = target + strlen(MET_SOCKET_PREFIX);
+        listen_fd = open_socket(path.c_str());
+        if (listen_fd < 0) return;
+        print("[MET] Serving metrics on unix socket %s\n", path.c_str());
+    } else {
+        path = target;
+        print("[MET] Writing metrics to %s\n", path.c_str());
+    }
+    updated = time(NULL);
+
+    running = true;
+    if (pthread_create(&publisher, NULL, publisher_thread, NULL)) {
+        perror("Could not start metrics thread");
+        running = false;
+    }
+}
+
+void MET_stop(void) {
+    if (!running) return;
+    MET_phase("done");
+    running = false;
+    pthread_join(publisher, NULL);
+
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        unlink(path.c_str());
+        listen_fd = -1;
+    } else {
+        write_file();
+    }
+}
+
+void MET_phase(const char *name) {
+    pthread_mutex_lock(&lock);
+    phase = name;
+    updated = time(NULL);
+    pthread_mutex_unlock(&lock);
+}
+
+/* whether a metrics sink is configured (see MET_start()) */
+bool MET_enabled(void) {
+    return running;
+}
+
+void MET_update(struct met_snapshot &snapshot) {
+    if (!running) return;
+    pthread_mutex_lock(&lock);
+    current = snapshot;
+    updated = time(NULL);
+    pthread_mutex_unlock(&lock);
+}
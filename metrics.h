@@ -0,0 +1,40 @@
+/*
+ * Copyright 2016, Victor van der Veen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdint.h>
+
+/* Progress counters, as maintained by TMPL_run() */
+struct met_snapshot {
+    int flips;
+    int exploitable;
+    int rows;                 // rows hammered
+    int64_t bytes_hammered;
+    int median_ns;            // median read time of the run
+    int row_median_ns;        // median read time of the last row
+    int row_p90_ns;           // highest p90 of any round of the last row
+    int runtime;              // seconds since templating started
+};
+
+void MET_start(const char *target);
+void MET_stop(void);
+void MET_phase(const char *phase);
+bool MET_enabled(void);
+void MET_update(struct met_snapshot &snapshot);
+
+#endif // __METRICS_H__
@@ -0,0 +1,126 @@
+/*
+ * Copyright 2016, Victor van der Veen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <linux/perf_event.h>
+
+#include "helper.h"
+#include "perf.h"
+
+/* ARM PMUs count bus accesses with the architected BUS_ACCESS event; other
+ * architectures only offer bus cycles as a generic event. */
+#if defined(__arm__) || defined(__aarch64__)
+#define BUS_TYPE   PERF_TYPE_RAW
+#define BUS_CONFIG 0x19
+#else
+#define BUS_TYPE   PERF_TYPE_HARDWARE
+#define BUS_CONFIG PERF_COUNT_HW_BUS_CYCLES
+#endif
+
+bool perf_enabled = false;
+
+static struct {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+    int fd;
+} counters[PERF_COUNTERS] = {
+    { "cycles",       PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES,   -1 },
+    { "llc_misses",   PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, -1 },
+    { "bus_accesses", BUS_TYPE,           BUS_CONFIG,                 -1 },
+};
+
+static int perf_event_open(struct perf_event_attr *attr, pid_t pid, int cpu, int group_fd, unsigned long flags) {
+    return syscall(__NR_perf_event_open, attr, pid, cpu, group_fd, flags);
+}
+
+/* Counters are opened one by one for this thread only (user space, any CPU),
+ * so that a PMU that lacks one event, or a kernel that only allows user space
+ * counting, still gives us the others. If none can be opened (no PMU access,
+ * perf_event_paranoid, seccomp), perf_enabled stays false and all other
+ * functions do nothing. */
+void PERF_init(void) {
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = counters[i].type;
+        attr.config = counters[i].config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+
+        counters[i].fd = perf_event_open(&attr, 0, -1, -1, 0);
+        if (counters[i].fd < 0) {
+            print("[PERF] %-12s: not available (%s)\n", counters[i].name, strerror(errno));
+            continue;
+        }
+        print("[PERF] %-12s: ok\n", counters[i].name);
+        perf_enabled = true;
+    }
+    if (!perf_enabled) 
+        print("[PERF] No counters available, continuing without\n");
+}
+
+void PERF_fini(void) {
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        if (counters[i].fd >= 0) close(counters[i].fd);
+        counters[i].fd = -1;
+    }
+    perf_enabled = false;
+}
+
+bool PERF_available(int counter) {
+    return counters[counter].fd >= 0;
+}
+
+const char *PERF_name(int counter) {
+    return counters[counter].name;
+}
+
+void PERF_read(struct perf_counts *counts) {
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        counts->value[i] = 0;
+        if (counters[i].fd < 0) continue;
+        if (read(counters[i].fd, &counts->value[i], sizeof(uint64_t)) != sizeof(uint64_t)) 
+            counts->value[i] = 0;
+    }
+}
+
+void PERF_diff(struct perf_counts *before, struct perf_counts *after, struct perf_counts *delta) {
+    for (int i = 0; i < PERF_COUNTERS; i++) 
+        delta->value[i] = after->value[i] - before->value[i];
+}
+
+void PERF_add(struct perf_counts *total, struct perf_counts *delta) {
+    for (int i = 0; i < PERF_COUNTERS; i++) 
+        total->value[i] += delta->value[i];
+}
+
+/* print all available counters, and per memory access if <reads> is given */
+void PERF_print(const char *prefix, struct perf_counts *counts, uint64_t reads) {
+    print("%s", prefix);
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        if (counters[i].fd < 0) continue;
+        print(" | %s: %llu", counters[i].name, (unsigned long long) counts->value[i]);
+        if (reads) print(" (%.2f per read)", (double) counts->value[i] / reads);
+    }
+    print("\n");
+}
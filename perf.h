@@ -0,0 +1,44 @@
+/*
+ * Copyright 2016, Victor van der Veen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __PERF_H__
+#define __PERF_H__
+
+#include <stdint.h>
+
+enum {
+    PERF_CYCLES,
+    PERF_LLC_MISSES,
+    PERF_BUS_ACCESSES,
+    PERF_COUNTERS
+};
+
+struct perf_counts {
+    uint64_t value[PERF_COUNTERS];
+};
+
+extern bool perf_enabled;    // at least one counter could be opened
+
+void PERF_init(void);
+void PERF_fini(void);
+bool PERF_available(int counter);
+const char *PERF_name(int counter);
+void PERF_read(struct perf_counts *counts);
+void PERF_diff(struct perf_counts *before, struct perf_counts *after, struct perf_counts *delta);
+void PERF_add(struct perf_counts *total, struct perf_counts *delta);
+void PERF_print(const char *prefix, struct perf_counts *counts, uint64_t reads);
+
+#endif // __PERF_H__
@@ -22,6 +22,7 @@
 
 #include <assert.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -31,41 +32,129 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "deadline.h"
 #include "helper.h"
 #include "ion.h"
+#include "mapping.h"
 #include "massage.h"
+#include "memwatch.h"
+#include "metrics.h"
+#include "perf.h"
 #include "rowsize.h"
+#include "rt.h"
+#include "telemetry.h"
 #include "templating.h"
+#include "weakdb.h"
 
 #define HAMMER_READCOUNT 1000000
+#define SWEEP_ROWS       128
 
-FILE *global_of = NULL;
 
 extern int rowsize;
 
 
 
+/* long-only options */
+enum {
+    OPT_SEED = 256,
+    OPT_STRATIFIED,
+    OPT_SYSFS,
+    OPT_MAX_TEMP,
+    OPT_RESUME_TEMP,
+    OPT_METRICS,
+    OPT_PERF,
+    OPT_RT,
+    OPT_RETENTION,
+    OPT_BATCH,
+    OPT_BRUTE_FORCE,
+    OPT_BANDIT,
+    OPT_DB,
+    OPT_RETEST,
+    OPT_BUDGET,
+    OPT_MAX_MEM,
+    OPT_MIN_FREE,
+    OPT_MAX_PSI,
+    OPT_DMA_HEAP,
+    OPT_SCREEN,
+    OPT_SWEEP,
+};
+
+static struct option long_options[] = {
+    {"seed", required_argument, NULL, OPT_SEED},
+    {"stratified", no_argument, NULL, OPT_STRATIFIED},
+    {"sysfs", required_argument, NULL, OPT_SYSFS},
+    {"max-temp", required_argument, NULL, OPT_MAX_TEMP},
+    {"resume-temp", required_argument, NULL, OPT_RESUME_TEMP},
+    {"metrics", required_argument, NULL, OPT_METRICS},
+    {"perf", no_argument, NULL, OPT_PERF},
+    {"rt", no_argument, NULL, OPT_RT},
+    {"retention", no_argument, NULL, OPT_RETENTION},
+    {"batch", required_argument, NULL, OPT_BATCH},
+    {"brute-force", no_argument, NULL, OPT_BRUTE_FORCE},
+    {"bandit", required_argument, NULL, OPT_BANDIT},
+    {"db", required_argument, NULL, OPT_DB},
+    {"retest", no_argument, NULL, OPT_RETEST},
+    {"budget", required_argument, NULL, OPT_BUDGET},
+    {"max-mem", required_argument, NULL, OPT_MAX_MEM},
+    {"min-free", required_argument, NULL, OPT_MIN_FREE},
+    {"max-psi", required_argument, NULL, OPT_MAX_PSI},
+    {"dma-heap", required_argument, NULL, OPT_DMA_HEAP},
+    {"screen", required_argument, NULL, OPT_SCREEN},
+    {"sweep", required_argument, NULL, OPT_SWEEP},
+    {NULL, 0, NULL, 0}
+};
+
 void usage(char *main_program) {
-    fprintf(stderr,"Usage: %s [-a] [-c count] [-d seconds] [-f file] [-h] [-i] [-q cpu] [-r rowsize] [-t timer]\n", main_program);
+    fprintf(stderr,"Usage: %s [-a] [-c count] [-d seconds] [-f file] [-h] [-i] [-m] [-q cpu] [-r rowsize] [-t timer] [--seed n] [--stratified] [--sysfs dir] [--max-temp C] [--resume-temp C] [--metrics file|unix:path] [--perf] [--rt] [--retention] [--batch k] [--brute-force] [--bandit pct] [--db file] [--retest] [--budget phase:seconds] [--max-mem MB] [--min-free MB] [--max-psi pct] [--dma-heap name] [--screen count] [--sweep min:max[:rows]]\n", main_program);
     fprintf(stderr,"   -a        : Run all pattern combinations\n");
     fprintf(stderr,"   -c count  : Number of memory accesses per hammer round (default is %d)\n",HAMMER_READCOUNT);
     fprintf(stderr,"   -d seconds: Number of seconds to run defrag (default is disabled)\n");
     fprintf(stderr,"   -f file   : Write output to this file\n"); 
     fprintf(stderr,"   -h        : This help\n");
     fprintf(stderr,"   -i        : Run ion heap type detector\n");
+    fprintf(stderr,"   -m        : Detect the DRAM address mapping (bank functions, row bits)\n");
     fprintf(stderr,"   -q cpu    : Pin to this CPU\n");
     fprintf(stderr,"   -r rowsize: Rowsize of DRAM module in B (autodetect if not specified)\n");
-    fprintf(stderr,"   -s        : Hammer more conservative (currently set to hammering every 64 bytes)\n");
+    fprintf(stderr,"   -s        : Hammer more conservative (one offset per distinct bank mapping in a row)\n");
     fprintf(stderr,"   -t timer  : Number of seconds to hammer (default is to hammer everything)\n");
+    fprintf(stderr,"   --seed n  : Seed for the random patterns (default is time based)\n");
+    fprintf(stderr,"   --stratified: Hammer rows in stratified random order and estimate the flip density\n");
+    fprintf(stderr,"   --sysfs dir: Read CPU frequency and temperature from this sysfs tree (default is /sys)\n");
+    fprintf(stderr,"   --max-temp C: Pause hammering when the device gets hotter than this (default is disabled)\n");
+    fprintf(stderr,"   --resume-temp C: Resume hammering when the device cooled down to this (default is max-temp - 5)\n");
+    fprintf(stderr,"   --metrics file|unix:path: Publish a JSON progress snapshot to this file or Unix socket\n");
+    fprintf(stderr,"   --perf    : Count cycles, LLC misses and bus accesses of hammer rounds (if the PMU allows)\n");
+    fprintf(stderr,"   --rt      : Hammer with SCHED_FIFO and locked memory on an isolated or idle CPU (or the -q CPU)\n");
+    fprintf(stderr,"   --retention: Run a control pass without hammering and do not count retention errors as flips\n");
+    fprintf(stderr,"   --batch k : Hammer k rows in different banks per round (default is 1, at most %d)\n", TMPL_MAX_BATCH);
+    fprintf(stderr,"   --brute-force: Hammer every 64 bytes of a row\n");
+    fprintf(stderr,"   --bandit pct: Hammer each offset with the patterns that flip most, exploring others pct%% of the time\n");
+    fprintf(stderr,"   --db file : Merge the flipped cells into this weak cell database after templating\n");
+    fprintf(stderr,"   --retest  : Hammer the rows holding cells from the --db database first\n");
+    fprintf(stderr,"   --budget phase:seconds: Time budget of a phase (defrag, rowsize, exhaust, mapping, templating)\n");
+    fprintf(stderr,"   --max-mem MB : Hold at most this much ION memory\n");
+    fprintf(stderr,"   --min-free MB: Release chunks while the system has less memory available\n");
+    fprintf(stderr,"   --max-psi pct: Release chunks while memory pressure (PSI some avg10) is higher\n");
+    fprintf(stderr,"   --screen count: Screen all rows with this many reads per round first, then hammer the weak ones fully (implies -a)\n");
+    fprintf(stderr,"   --sweep min:max[:rows]: Find the read count at which sampled rows first flip, doubling from min to max (128 rows)\n");
+    fprintf(stderr,"   --dma-heap name: Allocate from this DMA-BUF heap instead of /dev/ion (default without /dev/ion: system)\n");
 }
 
-void resetter(uint8_t *pattern) {
-    for (int i = 0; i < MAX_ROWSIZE; i++) {
-        pattern[i] = rand() % 255;
+uint8_t *random_row(void) {
+    uint8_t *row = (uint8_t *) malloc(rowsize);
+    if (row == NULL) {
+        perror("Could not allocate random pattern");
+        exit(EXIT_FAILURE);
     }
+    return row;
 }
 
 
+void cancel_handler(int sig) {
+    DL_cancel();
+    signal(sig, SIG_DFL);
+}
+
 int main(int argc, char *argv[]) {
     printf("______   ______ _______ _______ _______ _______  ______  \n");
     printf("|     \\ |_____/ |_____| |  |  | |  |  | |______ |_____/ \n");
@@ -73,16 +162,41 @@ int main(int argc, char *argv[]) {
     printf("\n");
 
     int c;
-    int timer = 0;
     int alloc_timer = 0;
     char *outputfile = NULL;
+    char *metrics = NULL;
     int hammer_readcount = HAMMER_READCOUNT;
     bool heap_type_detector = false;
-    bool do_conservative = false;
+    int offsets = TMPL_OFFSETS_PAGE;
     bool all_patterns = false;
+    bool detect_mapping = false;
     int cpu_pinning = -1;
+    bool got_seed = false;
+    bool stratified = false;
+    bool perf = false;
+    bool rt = false;
+    bool retention = false;
+    int batch = 1;
+    int explore = -1;
+    char *db_path = NULL;
+    bool retest = false;
+    char *dma_heap = NULL;
+    int screen_readcount = 0;
+    int sweep_min = 0, sweep_max = 0, sweep_rows = SWEEP_ROWS;
+    struct tel_config tel_cfg = { 
+        .sysfs = "/sys", 
+        .interval_ms = 1000, 
+        .max_temp = 0, 
+        .resume_temp = 0,
+    };
+    struct mem_config mem_cfg = {
+        .max_bytes = 0,
+        .min_free_kb = 0,
+        .max_psi = 0,
+        .interval_ms = 500,
+    };
     opterr = 0;
-    while ((c = getopt(argc, argv, "sac:d:f:hiq:r:t:")) != -1) {
+    while ((c = getopt_long(argc, argv, "sac:d:f:himq:r:t:", long_options, NULL)) != -1) {
         switch (c) {
             case 'a':
                 all_patterns = true;
@@ -92,6 +206,7 @@ int main(int argc, char *argv[]) {
                 break;
             case 'd':
                 alloc_timer = strtol(optarg, NULL, 10);
+                DL_budget("defrag", alloc_timer);
                 break;
             case 'f':
                 outputfile = optarg;
@@ -102,6 +217,9 @@ int main(int argc, char *argv[]) {
             case 'i':
                 heap_type_detector = true;
                 break;
+            case 'm':
+                detect_mapping = true;
+                break;
             case 'q':
                 cpu_pinning = strtol(optarg, NULL, 10);
                 break;
@@ -109,14 +227,96 @@ int main(int argc, char *argv[]) {
                 rowsize = strtol(optarg, NULL, 10);
                 break;
             case 's':
-                do_conservative = true;
+                offsets = TMPL_OFFSETS_ADAPTIVE;
                 break;
             case 't':
-                timer = strtol(optarg, NULL, 10);
+                DL_budget("templating", strtol(optarg, NULL, 10));
+                break;
+            case OPT_SEED:
+                pattern_seed = strtoull(optarg, NULL, 0);
+                got_seed = true;
+                break;
+            case OPT_STRATIFIED:
+                stratified = true;
+                break;
+            case OPT_SYSFS:
+                tel_cfg.sysfs = optarg;
+                break;
+            case OPT_MAX_TEMP:
+                tel_cfg.max_temp = strtod(optarg, NULL) * 1000;
+                break;
+            case OPT_RESUME_TEMP:
+                tel_cfg.resume_temp = strtod(optarg, NULL) * 1000;
+                break;
+            case OPT_METRICS:
+                metrics = optarg;
+                break;
+            case OPT_PERF:
+                perf = true;
+                break;
+            case OPT_RT:
+                rt = true;
+                break;
+            case OPT_RETENTION:
+                retention = true;
+                break;
+            case OPT_BRUTE_FORCE:
+                offsets = TMPL_OFFSETS_ALL;
+                break;
+            case OPT_BANDIT:
+                explore = strtol(optarg, NULL, 10);
+                if (explore < 0 || explore > 100) {
+                    fprintf(stderr, "Exploration share should be between 0 and 100.\n");
+                    return 1;
+                }
+                break;
+            case OPT_DB:
+                db_path = optarg;
+                break;
+            case OPT_RETEST:
+                retest = true;
+                break;
+            case OPT_BUDGET:
+                if (!DL_budget(optarg)) {
+                    fprintf(stderr, "Budget should be given as <phase>:<seconds>.\n");
+                    return 1;
+                }
+                break;
+            case OPT_MAX_MEM:
+                mem_cfg.max_bytes = strtoll(optarg, NULL, 10) * M(1);
+                break;
+            case OPT_MIN_FREE:
+                mem_cfg.min_free_kb = strtol(optarg, NULL, 10) * 1024;
+                break;
+            case OPT_MAX_PSI:
+                mem_cfg.max_psi = strtol(optarg, NULL, 10);
+                break;
+            case OPT_SCREEN:
+                screen_readcount = strtol(optarg, NULL, 10);
+                all_patterns = true;    // for the second stage
+                break;
+            case OPT_SWEEP:
+                if (sscanf(optarg, "%d:%d:%d", &sweep_min, &sweep_max, &sweep_rows) < 2 || 
+                        sweep_min < 1 || sweep_max < sweep_min || sweep_rows < 1) {
+                    fprintf(stderr, "Sweep should be given as <min>:<max>[:<rows>], with 0 < min <= max.\n");
+                    return 1;
+                }
+                break;
+            case OPT_DMA_HEAP:
+                dma_heap = optarg;
+                break;
+            case OPT_BATCH:
+                batch = strtol(optarg, NULL, 10);
+                if (batch < 1 || batch > TMPL_MAX_BATCH) {
+                    fprintf(stderr, "Batch size should be between 1 and %d.\n", TMPL_MAX_BATCH);
+                    return 1;
+                }
                 break;
             case '?':
                 if (optopt == 'c' || optopt == 'd' || optopt == 'f' || optopt == 'q' || optopt == 'r' || optopt == 't') 
                     fprintf(stderr, "Option -%c requires an argument.\n", optopt);
+                else if (optopt == 0 || optopt >= OPT_SEED)
+                    fprintf(stderr, "Unknown or incomplete option `%s'.\n", argv[optind - 1]);
                 else if (isprint(optopt))
                     fprintf(stderr,"Unknown option `-%c'.\n", optopt);
                 else
@@ -129,11 +329,16 @@ int main(int argc, char *argv[]) {
     }
 
 
+    if (retest && db_path == NULL) {
+        fprintf(stderr, "Option --retest requires --db.\n");
+        return 1;
+    }
+
     printf("[MAIN] ION init\n");
-    ION_init();
+    ION_init(dma_heap);
     
-    std::vector<struct ion_data *> ion_chunks;
-    std::vector<struct template_t *> templates;
+    struct ion_chunks ion_chunks;
+    struct template_arena templates;
 
     if (outputfile != NULL) {
         global_of = fopen(outputfile, "w");
@@ -147,11 +352,37 @@ int main(int argc, char *argv[]) {
     setvbuf(stdout, NULL, _IONBF, 0);
     
 
+    /* the first SIGINT or SIGTERM lets the current phase wrap up (see deadline.h) */
+    signal(SIGINT,  cancel_handler);
+    signal(SIGTERM, cancel_handler);
+
+    if (!got_seed) pattern_seed = get_ns();
+    print("[MAIN] Pattern seed: %llu\n", (unsigned long long) pattern_seed);
+
     if (heap_type_detector) {
         ION_detector();
         return 0;
     }
+
+    if (metrics) MET_start(metrics);
+
+    /*** MEMORY WATCHDOG */
+    if (MEM_start(mem_cfg)) 
+        printf("[MAIN] Started memory watchdog\n");
     
+    /*** PERFORMANCE COUNTERS */
+    if (perf) {
+        printf("[MAIN] Opening performance counters\n");
+        PERF_init();
+    }
+
+    /*** CACHING */
+    printf("[MAIN] Probing ION heap caching\n");
+    if (ION_probe_caching() < 0) {
+        fprintf(stderr, "Our ION heap is only mapped cached, can not hammer it on this CPU\n");
+        exit(EXIT_FAILURE);
+    }
+
     if (cpu_pinning != -1) {
         printf("[MAIN] Pinning to CPU...\n");
         cpu_set_t cpuset;
@@ -165,19 +396,45 @@ int main(int argc, char *argv[]) {
     /*** DEFRAG MEMORY */
     if (alloc_timer) {
         printf("[MAIN] Defragment memory\n");
-        defrag(alloc_timer);
+        MET_phase("defrag");
+        DL_phase("defrag");
+        defrag();
     }
     
     /*** ROW SIZE DETECTION (if not specified) */
     if (!VALID_ROWSIZES.count(rowsize)) {
         printf("[MAIN] No or weird row size provided, trying auto detect\n");
+        MET_phase("rowsize");
+        DL_phase("rowsize");
         rowsize = RS_autodetect();
     }
     print("[MAIN] Row size: %d\n", rowsize);
 
     /*** EXHAUST */
     printf("[MAIN] Exhaust ION chunks for templating\n");
+    MET_phase("exhaust");
+    DL_phase("exhaust");
     exhaust(ion_chunks, rowsize * 4);
+    MEM_report("exhaust");
+
+    /*** WEAK CELLS */
+    struct weak_db weak_db;
+    std::set<uintptr_t> weak_rows;
+    if (db_path) {
+        WDB_load(db_path, weak_db);
+        if (retest) {
+            printf("[MAIN] Locating known weak cells\n");
+            WDB_locate(weak_db, ion_chunks, weak_rows);
+        }
+    }
+
+    /*** ADDRESS MAPPING */
+    if (detect_mapping) {
+        printf("[MAIN] Detecting DRAM address mapping\n");
+        MET_phase("mapping");
+        DL_phase("mapping");
+        MAP_detect(ion_chunks);
+    }
 
     
     /* patterns:  above      victim     below
@@ -197,38 +454,34 @@ int main(int argc, char *argv[]) {
      * pr0r       0x<RANDOM> 0x00000000 0x<RANDOM>
      * prr0       0x<RANDOM> 0x<RANDOM> 0x00000000
      * prrr       0x<RANDOM> 0x<RANDOM> 0x<RANDOM>
+     *
+     * Each random row has its own buffer so that its content only depends on
+     * the seed, the pattern and its generation (see TMPL_fill_pattern()).
      */
     
     printf("[MAIN] Initializing patterns\n");
-    uint8_t  ones[MAX_ROWSIZE];
-    uint8_t zeros[MAX_ROWSIZE];
-    uint8_t rand1[MAX_ROWSIZE];
-    uint8_t rand2[MAX_ROWSIZE];
-    uint8_t rand3[MAX_ROWSIZE];
+    /* aligned for the 64-bit loads of the verify kernel */
+    alignas(64) uint8_t  ones[MAX_ROWSIZE];
+    alignas(64) uint8_t zeros[MAX_ROWSIZE];
     memset( ones, 0xff, MAX_ROWSIZE);
     memset(zeros, 0x00, MAX_ROWSIZE);
-    for (int i = 0; i < MAX_ROWSIZE; i++) {
-        rand1[i] = rand() % 255;
-        rand2[i] = rand() % 255;
-        rand3[i] = rand() % 255;
-    }
-
-    pattern_t p000 = { .above = zeros, .victim = zeros, .below = zeros, .cur_use = 0, .max_use = 0, .reset_above = NULL, .reset_victim = NULL, .reset_below = NULL };
-    pattern_t p001 = { .above = zeros, .victim = zeros, .below =  ones, .cur_use = 0, .max_use = 0, .reset_above = NULL, .reset_victim = NULL, .reset_below = NULL };
-    pattern_t p010 = { .above = zeros, .victim =  ones, .below = zeros, .cur_use = 0, .max_use = 0, .reset_above = NULL, .reset_victim = NULL, .reset_below = NULL };
-    pattern_t p011 = { .above = zeros, .victim =  ones, .below =  ones, .cur_use = 0, .max_use = 0, .reset_above = NULL, .reset_victim = NULL, .reset_below = NULL };
-    pattern_t p100 = { .above =  ones, .victim = zeros, .below = zeros, .cur_use = 0, .max_use = 0, .reset_above = NULL, .reset_victim = NULL, .reset_below = NULL };
-    pattern_t p101 = { .above =  ones, .victim = zeros, .below =  ones, .cur_use = 0, .max_use = 0, .reset_above = NULL, .reset_victim = NULL, .reset_below = NULL };
-    pattern_t p110 = { .above =  ones, .victim =  ones, .below = zeros, .cur_use = 0, .max_use = 0, .reset_above = NULL, .reset_victim = NULL, .reset_below = NULL };
-    pattern_t p111 = { .above =  ones, .victim =  ones, .below =  ones, .cur_use = 0, .max_use = 0, .reset_above = NULL, .reset_victim = NULL, .reset_below = NULL };
-
-    pattern_t p00r = { .above = zeros, .victim = zeros, .below = rand3, .cur_use = 0, .max_use = 100, .reset_above =     NULL, .reset_victim =     NULL, .reset_below = resetter };
-    pattern_t p0r0 = { .above = zeros, .victim = rand2, .below = zeros, .cur_use = 0, .max_use = 100, .reset_above =     NULL, .reset_victim = resetter, .reset_below =     NULL };
-    pattern_t p0rr = { .above = zeros, .victim = rand2, .below = rand3, .cur_use = 0, .max_use = 100, .reset_above =     NULL, .reset_victim = resetter, .reset_below = resetter };
-    pattern_t pr00 = { .above = rand1, .victim = zeros, .below = zeros, .cur_use = 0, .max_use = 100, .reset_above = resetter, .reset_victim =     NULL, .reset_below =     NULL };
-    pattern_t pr0r = { .above = rand1, .victim = zeros, .below = rand1, .cur_use = 0, .max_use = 100, .reset_above = resetter, .reset_victim =     NULL, .reset_below = resetter };
-    pattern_t prr0 = { .above = rand1, .victim = rand2, .below = zeros, .cur_use = 0, .max_use = 100, .reset_above = resetter, .reset_victim = resetter, .reset_below =     NULL };
-    pattern_t prrr = { .above = rand1, .victim = rand2, .below = rand3, .cur_use = 0, .max_use = 100, .reset_above = resetter, .reset_victim = resetter, .reset_below = resetter };
+
+    pattern_t p000 = { .name = "000", .above = zeros, .victim = zeros, .below = zeros, .cur_use = 0, .max_use = 0, .generation = 0 };
+    pattern_t p001 = { .name = "001", .above = zeros, .victim = zeros, .below =  ones, .cur_use = 0, .max_use = 0, .generation = 0 };
+    pattern_t p010 = { .name = "010", .above = zeros, .victim =  ones, .below = zeros, .cur_use = 0, .max_use = 0, .generation = 0 };
+    pattern_t p011 = { .name = "011", .above = zeros, .victim =  ones, .below =  ones, .cur_use = 0, .max_use = 0, .generation = 0 };
+    pattern_t p100 = { .name = "100", .above =  ones, .victim = zeros, .below = zeros, .cur_use = 0, .max_use = 0, .generation = 0 };
+    pattern_t p101 = { .name = "101", .above =  ones, .victim = zeros, .below =  ones, .cur_use = 0, .max_use = 0, .generation = 0 };
+    pattern_t p110 = { .name = "110", .above =  ones, .victim =  ones, .below = zeros, .cur_use = 0, .max_use = 0, .generation = 0 };
+    pattern_t p111 = { .name = "111", .above =  ones, .victim =  ones, .below =  ones, .cur_use = 0, .max_use = 0, .generation = 0 };
+
+    pattern_t p00r = { .name = "00r", .above =        zeros, .victim =        zeros, .below = random_row(), .cur_use = 0, .max_use = 100, .generation = 0 };
+    pattern_t p0r0 = { .name = "0r0", .above =        zeros, .victim = random_row(), .below =        zeros, .cur_use = 0, .max_use = 100, .generation = 0 };
+    pattern_t p0rr = { .name = "0rr", .above =        zeros, .victim = random_row(), .below = random_row(), .cur_use = 0, .max_use = 100, .generation = 0 };
+    pattern_t pr00 = { .name = "r00", .above = random_row(), .victim =        zeros, .below =        zeros, .cur_use = 0, .max_use = 100, .generation = 0 };
+    pattern_t pr0r = { .name = "r0r", .above = random_row(), .victim =        zeros, .below = random_row(), .cur_use = 0, .max_use = 100, .generation = 0 };
+    pattern_t prr0 = { .name = "rr0", .above = random_row(), .victim = random_row(), .below =        zeros, .cur_use = 0, .max_use = 100, .generation = 0 };
+    pattern_t prrr = { .name = "rrr", .above = random_row(), .victim = random_row(), .below = random_row(), .cur_use = 0, .max_use = 100, .generation = 0 };
 
     std::vector<struct pattern_t *> patterns;
     if (all_patterns) 
@@ -236,13 +489,59 @@ int main(int argc, char *argv[]) {
                            &p00r, &p0r0, &p0rr, &pr00, &pr0r, &prr0, &prrr};
     else
         patterns = {&p101, &p010};
+    for (auto pattern : patterns) {
+        TMPL_fill_pattern(pattern);
+    }
     
+    /*** TELEMETRY */
+    printf("[MAIN] Starting telemetry\n");
+    TEL_start(tel_cfg);
+
+    /*** REAL-TIME MODE */
+    if (rt) {
+        printf("[MAIN] Entering real-time mode\n");
+        RT_jitter("baseline");
+        RT_enter(cpu_pinning != -1 ? cpu_pinning : RT_pick_cpu(tel_cfg.sysfs));
+        RT_jitter("real-time");
+    }
+
     /*** TEMPLATE */
     printf("[MAIN] Start templating\n");
-    TMPL_run(ion_chunks, templates, patterns, timer, hammer_readcount, do_conservative);
+    MET_phase("templating");
+    DL_phase("templating");
+    struct tmpl_config cfg = { 
+        .hammer_readcount = hammer_readcount, 
+        .screen_readcount = screen_readcount,
+        .sweep_min = sweep_min,
+        .sweep_max = sweep_max,
+        .sweep_rows = sweep_rows,
+        .offsets = offsets, 
+        .stratified = stratified,
+        .retention = retention,
+        .batch = batch,
+        .bandit = explore >= 0,
+        .explore = explore,
+        .first_rows = &weak_rows,
+    };
+    TMPL_run(ion_chunks, templates, patterns, cfg);
+    DL_end();
+    MEM_report("templating");
+    TEL_stop();
+    if (rt) {
+        RT_report("templating");
+        RT_jitter("after");
+    }
+
+    if (db_path) {
+        WDB_merge(weak_db, templates, patterns);
+        WDB_save(db_path, weak_db);
+    }
   
     /*** CLEAN UP */
     ION_clean_all(ion_chunks);
+    MEM_stop();
+    MET_stop();
+    PERF_fini();
     
     printf("[MAIN] ION fini\n");
     ION_fini();
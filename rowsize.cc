@@ -27,8 +27,10 @@
 #include <sys/mman.h>
 #include <unistd.h>
 
+#include "deadline.h"
 #include "helper.h"
 #include "ion.h"
+#include "perf.h"
 #include "rowsize.h"
 
 #define ROWSIZE_READCOUNT 2500000 // 2.5 million reads
@@ -205,6 +207,16 @@ struct model *get_model(int *familiarity) {
 }
 
 
+/* the row size to assume if detection fails for <why> */
+static int fallback_rowsize(int familiarity, struct model *m, const char *why) {
+    if (familiarity == FAMILIAR_MODEL) {
+        print("[RS] WARNING! %s, assuming familiar model's rowsize %d\n", why, m->rowsize);
+        return m->rowsize;
+    }
+    print("[RS] WARNING! %s, assuming %d\n", why, DEFAULT_ROWSIZE);
+    return DEFAULT_ROWSIZE;
+}
+
 /* auto detect row size */
 int RS_autodetect(void) {
 
@@ -229,34 +241,54 @@ int RS_autodetect(void) {
    
     print("[RS] Reading from page 0 and page x (x = 0..%d)\n",ROWSIZE_PAGES);
     std::vector<uint64_t> deltas;
+    std::vector<struct perf_counts> perf;
     int page1 = 0;
+    bool truncated = false;
     volatile uintptr_t *virt1 = (volatile uintptr_t *) ((uint64_t) data.mapping + (page1 * PAGESIZE));
     for (int page2 = 0; page2 < ROWSIZE_PAGES; page2++) {
+        if (DL_expired()) {
+            print("\n[RS] Out of time after %d of %d pages", page2, ROWSIZE_PAGES);
+            truncated = true;
+            break;
+        }
         volatile uintptr_t *virt2 = (volatile uintptr_t *) ((uint64_t) data.mapping + (page2 * PAGESIZE));
 
+        struct perf_counts perf_before, perf_after, perf_delta;
+        if (perf_enabled) PERF_read(&perf_before);
         uint64_t t1 = get_ns();
         for (int i = 0; i < ROWSIZE_READCOUNT; i++) {
             *virt1;
             *virt2;
         }
         uint64_t t2 = get_ns();
+        if (perf_enabled) {
+            PERF_read(&perf_after);
+            PERF_diff(&perf_before, &perf_after, &perf_delta);
+            perf.push_back(perf_delta);
+        }
         deltas.push_back((t2 - t1) / ROWSIZE_READCOUNT);
 
-        print("%llu ", deltas.back());
+        print("%llu ", (unsigned long long) deltas.back());
     }
     print("\n");
 
-    if (munmap(data.mapping, data.len)) {
-        perror("Could not munmap");
-        exit(EXIT_FAILURE);
-    }
-    if (close(data.fd)) {
-        perror("Could not close");
-        exit(EXIT_FAILURE);
+    /* Every read of the probe should go to DRAM: if there are clearly less than
+     * one LLC miss (or bus access) per read, the timings above came (partly)
+     * from the cache and can not be trusted. */
+    for (int c = 0; c < PERF_COUNTERS && perf_enabled; c++) {
+        if (!PERF_available(c) || c == PERF_CYCLES) continue;
+        print("[RS] %s per read: ", PERF_name(c));
+        for (auto &p: perf) 
+            print("%.2f ", (double) p.value[c] / (ROWSIZE_READCOUNT * 2));
+        print("\n");
     }
-    if (ION_free(data.handle)) {
-        perror("Could not free");
-        exit(EXIT_FAILURE);
+
+    ION_clean(&data);   // on a DMA-BUF heap, the fd is the handle
+
+    /* a probe cut short looks like a small row size that may well be valid */
+    if (truncated || deltas.empty()) {
+        rowsize = fallback_rowsize(familiarity, m, "Row size probe did not complete");
+        return rowsize;
     }
 
     uint64_t q1, q2, q3;
@@ -264,13 +296,13 @@ int RS_autodetect(void) {
     uint64_t median = compute_median(deltas);
     uint64_t    mad = compute_mad   (deltas);
 
-    print("[RS] Median: %llu\n", median);
-    print("[RS] MAD: %llu\n", mad);
-    print("[RS] IQR: %llu\n", iqr);
+    print("[RS] Median: %llu\n", (unsigned long long) median);
+    print("[RS] MAD: %llu\n", (unsigned long long) mad);
+    print("[RS] IQR: %llu\n", (unsigned long long) iqr);
 
     // MAD, IQR and standard deviation all need some form of correction... :(
     iqr += 5;
-    print("[RS] Corrected IQR: %llu\n", iqr);
+    print("[RS] Corrected IQR: %llu\n", (unsigned long long) iqr);
 
 
     /* try simple algorithm first */
@@ -316,15 +348,8 @@ int RS_autodetect(void) {
 
 
     print("[RS] Detected row size: %d\n", rowsize);
-    if (!VALID_ROWSIZES.count(rowsize)) {
-        if (familiarity == FAMILIAR_MODEL) {
-            print("[RS] WARNING! Weird row size detected, assuming familiar model's rowsize %d\n", m->rowsize);
-            rowsize = m->rowsize;
-        } else {
-            print("[RS] WARNING! Weird row size detected, assuming %d\n", DEFAULT_ROWSIZE);
-            rowsize = DEFAULT_ROWSIZE;
-        }
-    }
+    if (!VALID_ROWSIZES.count(rowsize)) 
+        rowsize = fallback_rowsize(familiarity, m, "Weird row size detected");
 
     return rowsize;
 }
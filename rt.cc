@@ -0,0 +1,210 @@
+/*
+ * Copyright 2016, Victor van der Veen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "helper.h"
+#include "rt.h"
+
+#define RT_PRIORITY     1       // any SCHED_FIFO priority beats SCHED_OTHER
+#define RT_JITTER_MS    250     // busy loop duration of a jitter measurement
+#define RT_STALL_NS     5000    // gaps longer than this count as stalls
+#define RT_LOAD_MS      100     // /proc/stat sampling interval for picking a CPU
+
+/* parse a cpulist like "0-3,6" (as used in sysfs) */
+static std::set<int> read_cpulist(const std::string &path) {
+    std::set<int> cpus;
+    std::ifstream file(path.c_str());
+    std::string list;
+    if (!getline(file, list)) return cpus;
+
+    std::stringstream ss(list);
+    for (std::string range; getline(ss, range, ','); ) {
+        int first, last;
+        int n = sscanf(range.c_str(), "%d-%d", &first, &last);
+        if (n < 1) continue;
+        if (n == 1) last = first;
+        for (int cpu = first; cpu <= last; cpu++) cpus.insert(cpu);
+    }
+    return cpus;
+}
+
+/* busy and total jiffies of every CPU in /proc/stat */
+static void read_stat(std::vector<uint64_t> &busy, std::vector<uint64_t> &total) {
+    std::ifstream stat("/proc/stat");
+    for (std::string line; getline(stat, line); ) {
+        int cpu;
+        unsigned long long user, nice, system, idle, iowait = 0, irq = 0, softirq = 0, steal = 0;
+        if (sscanf(line.c_str(), "cpu%d %llu %llu %llu %llu %llu %llu %llu %llu", 
+                    &cpu, &user, &nice, &system, &idle, &iowait, &irq, &softirq, &steal) < 5) continue;
+        if (cpu >= (int) busy.size()) {
+            busy.resize(cpu + 1);
+            total.resize(cpu + 1);
+        }
+        busy[cpu]  = user + nice + system + irq + softirq + steal;
+        total[cpu] = busy[cpu] + idle + iowait;
+    }
+}
+
+/* Returns the first online CPU that is isolated from the scheduler (isolcpus=),
+ * or the online CPU with the lowest load over the next RT_LOAD_MS. */
+int RT_pick_cpu(const char *sysfs) {
+    std::string root = std::string(sysfs) + "/devices/system/cpu/";
+    std::set<int> online   = read_cpulist(root + "online");
+    std::set<int> isolated = read_cpulist(root + "isolated");
+
+    for (auto cpu : isolated) {
+        if (online.empty() || online.count(cpu)) {
+            print("[RT] Picked isolated CPU %d\n", cpu);
+            return cpu;
+        }
+    }
+
+    std::vector<uint64_t> busy1, total1, busy2, total2;
+    read_stat(busy1, total1);
+    usleep(RT_LOAD_MS * 1000);
+    read_stat(busy2, total2);
+
+    int best = -1;
+    double best_load = 2.0;
+    for (size_t cpu = 0; cpu < busy2.size() && cpu < busy1.size(); cpu++) {
+        if (!online.empty() && !online.count(cpu)) continue;
+        uint64_t dt = total2[cpu] - total1[cpu];
+        double load = dt ? (double) (busy2[cpu] - busy1[cpu]) / dt : 0.0;
+        if (load < best_load) {
+            best_load = load;
+            best = cpu;
+        }
+    }
+    if (best < 0) {
+        print("[RT] Could not determine CPU loads, not pinning\n");
+        return -1;
+    }
+    print("[RT] Picked least loaded CPU %d (load %.0f%%)\n", best, best_load * 100);
+    return best;
+}
+
+/* Pins the calling thread to <cpu> (if >= 0), switches it to SCHED_FIFO and
+ * locks all of our memory (patterns, page tables of the ION mappings) so that
+ * neither other processes nor paging interrupt the hammer loop. Each step may
+ * fail without root; we report it and go on with whatever we got. The kernel's
+ * RT throttling still leaves some time to other tasks on this CPU. */
+void RT_enter(int cpu) {
+    if (cpu >= 0) {
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(cpu, &cpuset);
+        if (sched_setaffinity(0, sizeof(cpuset), &cpuset)) 
+            print("[RT] Could not pin to CPU %d: %s\n", cpu, strerror(errno));
+        else
+            print("[RT] Pinned to CPU %d\n", cpu);
+    }
+
+    struct sched_param param;
+    param.sched_priority = RT_PRIORITY;
+    if (sched_setscheduler(0, SCHED_FIFO, &param)) 
+        print("[RT] Could not switch to SCHED_FIFO: %s\n", strerror(errno));
+    else 
+        print("[RT] Running with SCHED_FIFO priority %d\n", RT_PRIORITY);
+
+    if (mlockall(MCL_CURRENT | MCL_FUTURE)) 
+        print("[RT] Could not lock memory: %s\n", strerror(errno));
+    else
+        print("[RT] Locked all memory\n");
+}
+
+static void print_jitter(const char *when, struct rt_jitter *j) {
+    print("[RT] Jitter %-10s: stalls > %d us: %5d | max stall: %6llu us | time stolen: %6.3f%%\n", 
+            when, RT_STALL_NS / 1000, j->stalls, (unsigned long long) (j->max_ns / 1000), j->stolen * 100);
+}
+
+/* Busy loop for RT_JITTER_MS and report the stalls we observe */
+void RT_jitter(const char *when, struct rt_jitter *jitter) {
+    struct rt_jitter j = { 0, 0, 0.0 };
+    uint64_t stalled = 0;
+    uint64_t start = get_ns();
+    uint64_t end = start + RT_JITTER_MS * 1000000ULL;
+    uint64_t prev = start;
+    while (prev < end) {
+        uint64_t now = get_ns();
+        uint64_t gap = now - prev;
+        if (gap > RT_STALL_NS) {
+            j.stalls++;
+            stalled += gap;
+            if (gap > j.max_ns) j.max_ns = gap;
+        }
+        prev = now;
+    }
+    j.stolen = (double) stalled / (prev - start);
+
+    print_jitter(when, &j);
+    if (jitter) *jitter = j;
+}
+
+/* Jitter as seen by the hammer loop itself: a hammer round takes a timestamp
+ * after every slice of its reads (see do_hammer()), and all slices of a round
+ * read at the same rate, so the time a slice took beyond the median rate of
+ * its round was stolen. Slices last a millisecond or more, so a gap only
+ * counts as a stall if it also exceeds 1/RT_SLICE_NOISE of the slice, the
+ * normal spread of read times. */
+#define RT_SLICE_NOISE  16
+
+static struct rt_jitter run_jitter;
+static uint64_t run_busy_ns;
+static uint64_t run_stolen_ns;
+
+void RT_slices(const uint64_t *slice_ns, const int *slice_reads, int slices) {
+    if (slices == 0) return;
+    std::vector<double> rates(slices);
+    for (int i = 0; i < slices; i++) 
+        rates[i] = (double) slice_ns[i] / std::max(1, slice_reads[i]);
+    std::nth_element(rates.begin(), rates.begin() + slices / 2, rates.end());
+    double median = rates[slices / 2];
+
+    for (int i = 0; i < slices; i++) {
+        run_busy_ns += slice_ns[i];
+        uint64_t expected = median * slice_reads[i];
+        if (slice_ns[i] <= expected) continue;
+        uint64_t gap = slice_ns[i] - expected;
+        if (gap <= RT_STALL_NS || gap <= expected / RT_SLICE_NOISE) continue;
+        run_jitter.stalls++;
+        run_stolen_ns += gap;
+        if (gap > run_jitter.max_ns) run_jitter.max_ns = gap;
+    }
+}
+
+/* Report and reset the jitter collected by RT_slices() */
+void RT_report(const char *when, struct rt_jitter *jitter) {
+    run_jitter.stolen = run_busy_ns ? (double) run_stolen_ns / run_busy_ns : 0.0;
+    print_jitter(when, &run_jitter);
+    if (jitter) *jitter = run_jitter;
+    memset(&run_jitter, 0, sizeof(run_jitter));
+    run_busy_ns = 0;
+    run_stolen_ns = 0;
+}
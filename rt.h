@@ -0,0 +1,36 @@
+/*
+ * Copyright 2016, Victor van der Veen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __RT_H__
+#define __RT_H__
+
+#include <stdint.h>
+
+/* Scheduling jitter as seen by a busy loop: gaps between two consecutive
+ * timestamps longer than RT_STALL_NS are stalls (interrupts, preemption). */
+struct rt_jitter {
+    uint64_t max_ns;      // longest stall
+    int stalls;           // number of stalls
+    double stolen;        // fraction of the time lost to stalls
+};
+
+int  RT_pick_cpu(const char *sysfs);
+void RT_enter(int cpu);
+void RT_jitter(const char *when, struct rt_jitter *jitter = NULL);
+void RT_slices(const uint64_t *slice_ns, const int *slice_reads, int slices);
+void RT_report(const char *when, struct rt_jitter *jitter = NULL);
+
+#endif // __RT_H__
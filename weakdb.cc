@@ -0,0 +1,163 @@
+/*
+ * Copyright 2016, Victor van der Veen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <algorithm>
+#include <set>
+#include <string>
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "helper.h"
+#include "ion.h"
+#include "templating.h"
+#include "weakdb.h"
+
+/* The weak-row database is a text file with one line per cell:
+ *
+ *   <phys_addr> <flipped bits> <original byte> <pattern> <seen> <tested> <last seen>
+ *
+ * Cells are keyed by their physical address, so they stay valid across runs
+ * (until the device reboots into a different memory layout, which simply
+ * makes the cells fail their retest). */
+#define WDB_HEADER "# drammer weak cells: phys_addr flipped org_byte pattern seen tested last_seen\n"
+
+static inline uint64_t wdb_row(uint64_t phys_addr) {
+    return phys_addr - phys_addr % rowsize;
+}
+
+int WDB_load(const char *path, struct weak_db &db) {
+    db.cells.clear();
+    db.located.clear();
+
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        print("[WDB] No weak cell database at %s yet\n", path);
+        return 0;
+    }
+
+    char line[256];
+    int lineno = 0;
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        if (line[0] == '#' || line[0] == '\n') continue;
+
+        struct wdb_cell cell;
+        unsigned long long phys_addr;
+        unsigned int flipped, org_byte;
+        memset(&cell, 0, sizeof(cell));
+        if (sscanf(line, "%llx %x %x %3s %d %d %ld", &phys_addr, &flipped, &org_byte, 
+                    cell.pattern, &cell.seen, &cell.tested, &cell.last_seen) != 7) {
+            print("[WDB] Skipping malformed line %d of %s\n", lineno, path);
+            continue;
+        }
+        cell.phys_addr = phys_addr;
+        cell.flipped = flipped;
+        cell.org_byte = org_byte;
+        db.cells[cell.phys_addr] = cell;
+    }
+    fclose(f);
+
+    std::set<uint64_t> rows;
+    for (auto &it : db.cells) rows.insert(wdb_row(it.first));
+    print("[WDB] Loaded %d weak cells in %d rows from %s\n", (int) db.cells.size(), (int) rows.size(), path);
+    return db.cells.size();
+}
+
+/* write to <path>.tmp and rename, so an interrupted run never leaves a
+ * truncated database behind */
+bool WDB_save(const char *path, struct weak_db &db) {
+    std::string tmp = std::string(path) + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "w");
+    if (f == NULL) {
+        perror("[WDB] Could not write weak cell database");
+        return false;
+    }
+    fputs(WDB_HEADER, f);
+    for (auto &it : db.cells) {
+        struct wdb_cell &cell = it.second;
+        fprintf(f, "%llx %02x %02x %s %d %d %ld\n", (unsigned long long) cell.phys_addr, cell.flipped, cell.org_byte,
+                cell.pattern, cell.seen, cell.tested, cell.last_seen);
+    }
+    fclose(f);
+    if (rename(tmp.c_str(), path)) {
+        perror("[WDB] Could not replace weak cell database");
+        return false;
+    }
+    print("[WDB] Saved %d weak cells to %s\n", (int) db.cells.size(), path);
+    return true;
+}
+
+/* Find the known weak cells in the chunks we hold now. The virtual addresses
+ * of the victim rows holding them are added to <rows>, so that TMPL_run() can
+ * hammer these rows first. Returns the number of cells found. */
+int WDB_locate(struct weak_db &db, struct ion_chunks &chunks, std::set<uintptr_t> &rows) {
+    db.located.clear();
+    struct phys_index index;
+    TMPL_index_phys(chunks, index);
+    std::set<uint64_t> phys_rows;
+    for (auto &it : db.cells) {
+        struct template_t needle;
+        memset(&needle, 0, sizeof(needle));
+        needle.phys_addr = it.first;
+        if (find_template_in_rows(chunks, index, &needle) == NULL) continue;
+
+        db.located.push_back(it.first);
+        phys_rows.insert(wdb_row(it.first));
+        rows.insert((uintptr_t) chunks.mapping[needle.chunk] + tmpl_rel_row_index(&needle) * rowsize);
+    }
+    print("[WDB] Located %d of %d weak cells in %d physical rows (%d victim rows) of the current allocation\n", 
+            (int) db.located.size(), (int) db.cells.size(), (int) phys_rows.size(), (int) rows.size());
+    return db.located.size();
+}
+
+/* Merge the flips of this run into the database. Cells located by a retest
+ * count as tested, and we report how many of them flipped again. */
+void WDB_merge(struct weak_db &db, struct template_arena &templates, 
+               std::vector<struct pattern_t *> &patterns) {
+    std::set<uint64_t> flipped;
+    int added = 0;
+    for (auto tmpl : templates) {
+        if (tmpl->phys_addr == 0) continue;
+
+        auto it = db.cells.find(tmpl->phys_addr);
+        if (it == db.cells.end()) {
+            struct wdb_cell cell;
+            memset(&cell, 0, sizeof(cell));
+            cell.phys_addr = tmpl->phys_addr;
+            cell.org_byte = tmpl_org_byte(tmpl);
+            strncpy(cell.pattern, patterns[tmpl->pattern]->name, sizeof(cell.pattern) - 1);
+            it = db.cells.insert(std::make_pair(cell.phys_addr, cell)).first;
+            added++;
+        }
+        struct wdb_cell &cell = it->second;
+        cell.flipped |= tmpl_org_byte(tmpl) ^ tmpl_new_byte(tmpl);
+        cell.last_seen = std::max(cell.last_seen, (long) tmpl->found_at);
+        if (flipped.insert(tmpl->phys_addr).second) cell.seen++;
+    }
+
+    int reproduced = 0;
+    for (auto phys_addr : db.located) {
+        db.cells[phys_addr].tested++;
+        if (flipped.count(phys_addr)) reproduced++;
+    }
+    if (!db.located.empty()) 
+        print("[WDB] Retest: %d of %d located weak cells flipped again (%5.2f%%)\n", 
+                reproduced, (int) db.located.size(), reproduced * 100.0 / db.located.size());
+    print("[WDB] Merged %d flipped cells, %d of them new\n", (int) flipped.size(), added);
+}
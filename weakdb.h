@@ -0,0 +1,52 @@
+/*
+ * Copyright 2016, Victor van der Veen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef __WEAKDB_H__
+#define __WEAKDB_H__
+
+#include <map>
+#include <set>
+#include <vector>
+
+#include <stdint.h>
+
+#include "ion.h"
+#include "templating.h"
+
+/* A cell that flipped in an earlier run, keyed by its physical address */
+struct wdb_cell {
+    uint64_t phys_addr;
+    uint8_t flipped;          // bits of the byte seen flipping in any run
+    uint8_t org_byte;         // original value of the byte when it first flipped
+    char pattern[4];          // pattern that first flipped it
+    int seen;                 // runs in which the cell flipped
+    int tested;               // retest runs in which the cell was allocated
+    long last_seen;           // time(NULL) of the last flip
+};
+
+struct weak_db {
+    std::map<uint64_t, struct wdb_cell> cells;
+    std::vector<uint64_t> located;    // cells found in the current allocation by WDB_locate()
+};
+
+int  WDB_load(const char *path, struct weak_db &db);
+bool WDB_save(const char *path, struct weak_db &db);
+int  WDB_locate(struct weak_db &db, struct ion_chunks &chunks, std::set<uintptr_t> &rows);
+void WDB_merge(struct weak_db &db, struct template_arena &templates, 
+               std::vector<struct pattern_t *> &patterns);
+
+#endif // __WEAKDB_H__